@@ -22,6 +22,14 @@ typedef uint32_t block_sector_t;
 
 struct block;
 
+/* One buffer of a multi-sector transfer.
+   LEN must be a multiple of BLOCK_SECTOR_SIZE. */
+struct block_iovec
+  {
+    void *base;                  /* Start of buffer. */
+    size_t len;                  /* Length of buffer in bytes. */
+  };
+
 /* Type of a block device. */
 enum block_type
   {
@@ -53,6 +61,10 @@ struct block *block_next (struct block *);
 block_sector_t block_size (struct block *);
 void block_read (struct block *, block_sector_t, void *);
 void block_write (struct block *, block_sector_t, const void *);
+void block_readv (struct block *, block_sector_t,
+                  const struct block_iovec *, size_t iov_cnt);
+void block_writev (struct block *, block_sector_t,
+                   const struct block_iovec *, size_t iov_cnt);
 const char *block_name (struct block *);
 enum block_type block_type (struct block *);
 
@@ -65,6 +77,15 @@ struct block_operations
   {
     void (*read) (void *aux, block_sector_t, void *buffer);
     void (*write) (void *aux, block_sector_t, const void *buffer);
+
+    /* Optional. Transfer CNT consecutive sectors starting at the given
+       sector in a single request, scattered to or gathered from IOV.
+       If NULL, block_readv() and block_writev() fall back to calling
+       read or write once per sector. */
+    void (*read_multi) (void *aux, block_sector_t, block_sector_t cnt,
+                        const struct block_iovec *iov, size_t iov_cnt);
+    void (*write_multi) (void *aux, block_sector_t, block_sector_t cnt,
+                         const struct block_iovec *iov, size_t iov_cnt);
   };
 
 struct block *block_register (const char *name, enum block_type,
@@ -3,6 +3,8 @@
 
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
+#include "filesys/off_t.h"
 #include "devices/block.h"
 
 /* Maximum length of a file name component.
@@ -12,8 +14,29 @@
 #define NAME_MAX 14
 
 struct inode;
+struct dir;
+
+/* Entry filled in by dir_readdir_batch(). Records are packed one after
+   the other, each REC_LEN bytes long and 4 byte aligned. NAME is null
+   terminated, FILE_TYPE is one of EXT2_FT_*. */
+struct dir_record {
+	uint32_t inode;
+	uint16_t rec_len;
+	uint8_t name_len;
+	uint8_t file_type;
+	char name[];
+};
+
+/* Opening and closing directories. */
+struct dir *dir_open (const char *path);
+void dir_close (struct dir *);
 
 /* Reading and writing. */
 struct directory *dir_lookup(struct block *d, const char *path);
+int dir_readdir_batch (struct dir *, void *buffer, size_t size);
+
+/* Directory position, a cookie to resume reading from. */
+void dir_seek (struct dir *, off_t cookie);
+off_t dir_tell (struct dir *);
 
 #endif /* filesys/directory.h */
@@ -0,0 +1,730 @@
+#include "filesys/ext2/cache.h"
+#include "devices/block.h"
+#include "kernel/kmalloc.h"
+#include "kernel/synch.h"
+#include "kernel/thread.h"
+#include "devices/timer.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <list.h>
+#include <debug.h>
+
+/*
+ * Block buffer cache.
+ * Every file system block read or written through ext2_read_block() and
+ * ext2_write_block() is kept in one of a fixed number of buffers, keyed by
+ * (device, fs block). Callers may also borrow a buffer directly with
+ * cache_get() and return it with cache_put(), which avoids a kmalloc and a
+ * copy for metadata that is only inspected or patched in place.
+ * Buffers are replaced with the CLOCK algorithm, buffers in use are never
+ * evicted. Buffers of blocks callers do not need again, passed to
+ * cache_demote(), cache_drop() or cache_discard(), go to a cold list and
+ * are reused before CLOCK is consulted.
+ * In write-back mode (the default) cache_mark_dirty() only marks the buffer.
+ * Dirty buffers are written in ascending block order by a flusher thread
+ * once they are older than the dirty age, or all at once when the dirty
+ * ratio is exceeded, by cache_flush() and when they are evicted.
+ * Dirty buffers of consecutive blocks are written in a single request.
+ * cache_flush() and cache_flush_blocks() also write buffers another flush
+ * is still writing, so everything dirty on entry is on the device on return.
+ * In write-through mode cache_mark_dirty() writes the buffer immediately.
+ * Metadata kept outside the cache (e.g. allocation bitmaps) is copied into
+ * buffers by the flush hook before the flusher and cache_flush() write.
+*/
+
+#define CACHE_BUCKETS 256
+#define CACHE_MAX_RUN 64	// max buffers written in one device request
+
+struct cache_block {
+	struct block *device;	// owning device, NULL if the buffer is unused
+	uint32_t block_idx;		// fs block number
+	void *data;				// block content, block size bytes
+	int ref_cnt;			// number of borrowed handles
+	bool valid;				// data holds the block content
+	bool accessed;			// CLOCK reference bit
+	bool dirty;				// modified since last written to device
+	bool prefetched;		// read ahead and not accessed yet
+	bool filling;			// borrowed unread, LOCK held until filled
+	bool cold;				// on the cold list
+	int writers;			// flushes currently writing the buffer
+	int64_t dirty_since;	// timer tick the buffer became dirty
+	struct list_elem elem;	// hash bucket element
+	struct list_elem cold_elem;	// cold list element, if COLD
+	struct lock lock;		// serialises device I/O of this buffer
+};
+
+// Blocks selected by cache_filter_range()
+struct cache_range {
+	uint32_t start;
+	uint32_t count;
+};
+
+static struct cache_block *cache_blocks;
+static uint32_t cache_slots;
+static uint32_t cache_block_size;
+static uint32_t cache_hand;
+static struct list cache_buckets[CACHE_BUCKETS];
+static struct list cache_cold; // demoted and dropped buffers, reused first
+
+// Write-back state
+static bool cache_write_back = true;
+static uint32_t cache_dirty_age = CACHE_DIRTY_AGE_MS;
+static uint32_t cache_dirty_ratio = CACHE_DIRTY_RATIO;
+static uint32_t cache_dirty_cnt;
+static volatile bool cache_flusher_stop;
+static cache_flush_hook_func *cache_flush_hook;
+
+// Statistics
+static uint64_t cache_hits;
+static uint64_t cache_misses;
+static uint64_t cache_writes;
+static uint64_t cache_ra_blocks;
+static uint64_t cache_ra_hits;
+static uint64_t cache_ra_wasted;
+
+// Synchronisation Mechanisms
+static struct lock cache_lock;
+static struct semaphore cache_flusher_done;
+
+static struct list *cache_bucket(struct block *d, uint32_t block_idx);
+static struct cache_block *cache_lookup(struct block *d, uint32_t block_idx);
+static struct cache_block *cache_range_buffer(struct block *d, uint32_t block_idx, uint32_t count, uint32_t i);
+static bool cache_filter_range(uint32_t block_idx, void *aux);
+static struct cache_block *cache_evict(void);
+static void cache_make_cold(struct cache_block *b);
+static void cache_end_fill(struct cache_block *b);
+static void cache_read_device(struct cache_block *b);
+static void cache_write_device(struct cache_block *b);
+static void cache_write_run(struct cache_block **run, uint32_t cnt);
+static void cache_flush_dirty(struct block *d, int64_t older_than, bool sync, cache_filter_func *filter, void *aux);
+static int cache_compare_block(const void *a, const void *b);
+static void cache_flusher(void *aux);
+
+/* Initialise the buffer cache for file systems of BLOCK_SIZE bytes blocks */
+void cache_init(uint32_t block_size){
+	uint32_t i;
+
+	ASSERT(block_size > 0 && (block_size % BLOCK_SECTOR_SIZE) == 0);
+
+	// Cache is shared by all registered devices
+	if(cache_blocks != NULL){
+		ASSERT(block_size == cache_block_size);
+		return;
+	}
+
+	cache_block_size = block_size;
+	cache_slots = CACHE_BUDGET / block_size;
+	cache_hand = 0;
+	cache_dirty_cnt = 0;
+	cache_hits = cache_misses = cache_writes = 0;
+	cache_ra_blocks = cache_ra_hits = cache_ra_wasted = 0;
+	lock_init(&cache_lock);
+	for(i = 0; i < CACHE_BUCKETS; i++)
+		list_init(&cache_buckets[i]);
+	list_init(&cache_cold);
+
+	// Buffer memory is allocated on first use
+	cache_blocks = kmalloc(cache_slots * sizeof(struct cache_block));
+	ASSERT(cache_blocks != NULL);
+	memset(cache_blocks,0,cache_slots * sizeof(struct cache_block));
+	for(i = 0; i < cache_slots; i++)
+		lock_init(&cache_blocks[i].lock);
+
+	// Start background flusher
+	cache_flusher_stop = false;
+	sema_init(&cache_flusher_done,0);
+	if(thread_create("ext2-flusher",PRI_DEFAULT,cache_flusher,NULL) == TID_ERROR)
+		PANIC("Buffer cache: cannot create flusher thread.");
+}
+
+/* Release all buffers */
+void cache_free(void){
+	uint32_t i;
+
+	if(cache_blocks == NULL) return;
+
+	// Stop flusher and write remaining dirty buffers
+	cache_flusher_stop = true;
+	sema_down(&cache_flusher_done);
+	cache_flush(NULL);
+
+	for(i = 0; i < cache_slots; i++){
+		ASSERT(cache_blocks[i].ref_cnt == 0);
+		if(cache_blocks[i].data != NULL) kfree(cache_blocks[i].data);
+	}
+	kfree(cache_blocks);
+	cache_blocks = NULL;
+}
+
+/* Borrow the buffer of BLOCK_IDX on device D.
+ * If READ is false the caller is going to overwrite the whole block,
+ * so the block is not read from the device on a miss. Until the caller
+ * calls cache_mark_dirty() or cache_put() the buffer stays locked, other
+ * users wait instead of seeing it half filled.
+ * The buffer must be returned with cache_put().
+*/
+struct cache_block *cache_get(struct block *d, uint32_t block_idx, bool read){
+	struct cache_block *b, *found;
+
+	ASSERT(d != NULL && cache_blocks != NULL);
+
+	lock_acquire(&cache_lock);
+	b = cache_lookup(d,block_idx);
+	if(b != NULL){
+		cache_hits++;
+		if(b->prefetched){
+			b->prefetched = false;
+			cache_ra_hits++;
+		}
+	}
+	else{
+		cache_misses++;
+		b = cache_evict();
+		// Cached by another thread while a victim was written
+		found = cache_lookup(d,block_idx);
+		if(found != NULL){
+			cache_make_cold(b);
+			b = found;
+		}
+		else{
+			b->device = d;
+			b->block_idx = block_idx;
+			b->valid = false;
+			list_push_front(cache_bucket(d,block_idx),&b->elem);
+		}
+	}
+	b->ref_cnt++;
+	b->accessed = true;
+	lock_release(&cache_lock);
+
+	// Fill buffer outside of the cache lock
+	lock_acquire(&b->lock);
+	if(!b->valid){
+		// Caller fills it, keep the lock until then
+		if(!read){
+			b->filling = true;
+			return b;
+		}
+		cache_read_device(b);
+		b->valid = true;
+	}
+	lock_release(&b->lock);
+
+	return b;
+}
+
+/* Borrow the buffer of BLOCK_IDX on device D only if it is cached,
+ * returns NULL otherwise. A buffer still being filled is waited for, so
+ * its content is never older than the device.
+*/
+struct cache_block *cache_find(struct block *d, uint32_t block_idx){
+	struct cache_block *b;
+
+	ASSERT(d != NULL && cache_blocks != NULL);
+
+	lock_acquire(&cache_lock);
+	b = cache_lookup(d,block_idx);
+	if(b != NULL){
+		cache_hits++;
+		if(b->prefetched){
+			b->prefetched = false;
+			cache_ra_hits++;
+		}
+		b->ref_cnt++;
+		b->accessed = true;
+	}
+	lock_release(&cache_lock);
+	if(b == NULL) return NULL;
+
+	// Wait for a fill in progress, read the block if nobody started it
+	lock_acquire(&b->lock);
+	if(!b->valid){
+		cache_read_device(b);
+		b->valid = true;
+	}
+	lock_release(&b->lock);
+
+	return b;
+}
+
+/* Read COUNT consecutive blocks starting at BLOCK_IDX into the cache
+ * ahead of use. Each run of blocks not cached yet is read in a single
+ * request scattered into the buffers.
+*/
+void cache_prefetch(struct block *d, uint32_t block_idx, uint32_t count){
+	struct cache_block *run[CACHE_MAX_RUN];
+	struct block_iovec iov[CACHE_MAX_RUN];
+	uint32_t sectors = cache_block_size / BLOCK_SECTOR_SIZE;
+	uint32_t i, j, cnt;
+
+	ASSERT(d != NULL && cache_blocks != NULL);
+
+	// Never prefetch more than a quarter of the cache
+	if(count > cache_slots / 4) count = cache_slots / 4;
+
+	for(i = 0; i < count; i += cnt){
+		// Claim buffers for a run of uncached blocks
+		cnt = 0;
+		lock_acquire(&cache_lock);
+		while(i + cnt < count && cnt < CACHE_MAX_RUN){
+			struct cache_block *b = cache_lookup(d,block_idx+i+cnt);
+			if(b != NULL) break;
+			b = cache_evict();
+			// Cached by another thread while a victim was written
+			if(cache_lookup(d,block_idx+i+cnt) != NULL){
+				cache_make_cold(b);
+				break;
+			}
+			b->device = d;
+			b->block_idx = block_idx+i+cnt;
+			b->valid = false;
+			b->accessed = true;
+			b->ref_cnt++;
+			// Unused buffer, taking its lock cannot block
+			lock_acquire(&b->lock);
+			list_push_front(cache_bucket(d,b->block_idx),&b->elem);
+			run[cnt] = b;
+			iov[cnt].base = b->data;
+			iov[cnt].len = cache_block_size;
+			cnt++;
+		}
+		lock_release(&cache_lock);
+
+		// Block already cached, skip it
+		if(cnt == 0){
+			cnt = 1;
+			continue;
+		}
+
+		// Read the run in one request
+		block_readv(d,run[0]->block_idx * sectors,iov,cnt);
+		for(j = 0; j < cnt; j++){
+			run[j]->valid = true;
+			run[j]->prefetched = true;
+			lock_release(&run[j]->lock);
+		}
+		lock_acquire(&cache_lock);
+		cache_ra_blocks += cnt;
+		for(j = 0; j < cnt; j++) run[j]->ref_cnt--;
+		lock_release(&cache_lock);
+	}
+}
+
+/* Drop the buffers of COUNT blocks starting at BLOCK_IDX, which are no
+ * longer in use by the file system. Dirty content is not written.
+ * Buffers currently borrowed are left alone.
+*/
+void cache_discard(struct block *d, uint32_t block_idx, uint32_t count){
+	struct cache_block *b;
+	uint32_t i;
+
+	ASSERT(d != NULL);
+	if(cache_blocks == NULL) return;
+
+	lock_acquire(&cache_lock);
+	for(i = 0; i < count && i < cache_slots; i++){
+		b = cache_range_buffer(d,block_idx,count,i);
+		if(b == NULL || b->ref_cnt > 0) continue;
+
+		if(b->dirty){
+			b->dirty = false;
+			cache_dirty_cnt--;
+		}
+		b->prefetched = false;
+		b->accessed = false;
+		b->valid = false;
+		list_remove(&b->elem);
+		b->device = NULL;
+		cache_make_cold(b);
+	}
+	lock_release(&cache_lock);
+}
+
+/* Write the dirty buffers of COUNT blocks starting at BLOCK_IDX and drop
+ * them, the blocks are not going to be used again soon.
+ * Buffers borrowed or modified again meanwhile are left alone.
+*/
+void cache_drop(struct block *d, uint32_t block_idx, uint32_t count){
+	struct cache_range range = {block_idx, count};
+	struct cache_block *b;
+	uint32_t i;
+
+	ASSERT(d != NULL);
+	if(cache_blocks == NULL) return;
+
+	cache_flush_dirty(d,INT64_MAX,true,cache_filter_range,&range);
+
+	lock_acquire(&cache_lock);
+	for(i = 0; i < count && i < cache_slots; i++){
+		b = cache_range_buffer(d,block_idx,count,i);
+		if(b == NULL || b->ref_cnt > 0 || b->dirty) continue;
+
+		b->prefetched = false;
+		b->accessed = false;
+		b->valid = false;
+		list_remove(&b->elem);
+		b->device = NULL;
+		cache_make_cold(b);
+	}
+	lock_release(&cache_lock);
+}
+
+/* COUNT blocks starting at BLOCK_IDX are not going to be used again soon,
+ * their buffers are replaced first unless they are accessed again.
+*/
+void cache_demote(struct block *d, uint32_t block_idx, uint32_t count){
+	struct cache_block *b;
+	uint32_t i;
+
+	ASSERT(d != NULL);
+	if(cache_blocks == NULL) return;
+
+	lock_acquire(&cache_lock);
+	for(i = 0; i < count && i < cache_slots; i++){
+		b = cache_range_buffer(d,block_idx,count,i);
+		if(b == NULL) continue;
+		b->accessed = false;
+		cache_make_cold(b);
+	}
+	lock_release(&cache_lock);
+}
+
+/* Return a borrowed buffer */
+void cache_put(struct cache_block *b){
+	ASSERT(b != NULL);
+
+	cache_end_fill(b);
+	lock_acquire(&cache_lock);
+	ASSERT(b->ref_cnt > 0);
+	b->ref_cnt--;
+	lock_release(&cache_lock);
+}
+
+/* Get the content of a borrowed buffer */
+void *cache_data(struct cache_block *b){
+	ASSERT(b != NULL && b->ref_cnt > 0);
+	return b->data;
+}
+
+/* Buffer content has been modified.
+ * In write-through mode it is written to the device immediately,
+ * otherwise it is left to the flusher.
+*/
+void cache_mark_dirty(struct cache_block *b){
+	ASSERT(b != NULL && b->ref_cnt > 0);
+
+	cache_end_fill(b);
+	if(!cache_write_back){
+		lock_acquire(&b->lock);
+		cache_write_device(b);
+		lock_release(&b->lock);
+		return;
+	}
+
+	lock_acquire(&cache_lock);
+	if(!b->dirty){
+		b->dirty = true;
+		b->dirty_since = timer_ticks();
+		cache_dirty_cnt++;
+	}
+	lock_release(&cache_lock);
+}
+
+/* Write all dirty buffers of device D, or of all devices if D is NULL */
+void cache_flush(struct block *d){
+	if(cache_blocks == NULL) return;
+	if(cache_flush_hook != NULL) cache_flush_hook();
+	cache_flush_dirty(d,INT64_MAX,true,NULL,NULL);
+}
+
+/* Write the dirty buffers of device D whose block FILTER accepts.
+ * The flush hook is not called.
+*/
+void cache_flush_blocks(struct block *d, cache_filter_func *filter, void *aux){
+	ASSERT(d != NULL && filter != NULL);
+	if(cache_blocks == NULL) return;
+	cache_flush_dirty(d,INT64_MAX,true,filter,aux);
+}
+
+/* Switch between write-back and write-through mode */
+void cache_set_write_back(bool enable){
+	cache_write_back = enable;
+	if(!enable) cache_flush(NULL);
+}
+
+/* Set HOOK to be called before dirty buffers are written, NULL to clear */
+void cache_set_flush_hook(cache_flush_hook_func *hook){
+	cache_flush_hook = hook;
+}
+
+/* Set flusher thresholds: buffers dirty for more than AGE_MS milliseconds
+ * are written, and all dirty buffers are written once more than
+ * DIRTY_RATIO percent of the buffers are dirty.
+*/
+void cache_set_flush_policy(uint32_t age_ms, uint32_t dirty_ratio){
+	ASSERT(dirty_ratio <= 100);
+	cache_dirty_age = age_ms;
+	cache_dirty_ratio = dirty_ratio;
+}
+
+void cache_print_stats(void){
+	printf("Buffer cache: %"PRIu64" hits, %"PRIu64" misses, %"PRIu64" writes, %u buffers of %u bytes\n",
+		cache_hits, cache_misses, cache_writes, cache_slots, cache_block_size);
+	printf("Readahead: %"PRIu64" blocks, %"PRIu64" hits, %"PRIu64" wasted\n",
+		cache_ra_blocks, cache_ra_hits, cache_ra_wasted);
+}
+
+static struct list *cache_bucket(struct block *d, uint32_t block_idx){
+	uint32_t hash = (uint32_t)(uintptr_t)d ^ (block_idx * 2654435761u);
+	return &cache_buckets[hash % CACHE_BUCKETS];
+}
+
+/* Find buffer of BLOCK_IDX, cache lock must be held */
+static struct cache_block *cache_lookup(struct block *d, uint32_t block_idx){
+	struct list *bucket = cache_bucket(d,block_idx);
+	struct list_elem *e;
+	struct cache_block *b;
+
+	ASSERT(lock_held_by_current_thread(&cache_lock));
+
+	for(e = list_begin(bucket); e != list_end(bucket); e = list_next(e)){
+		b = list_entry(e,struct cache_block,elem);
+		if(b->device == d && b->block_idx == block_idx) return b;
+	}
+	return NULL;
+}
+
+/* Buffer of the I th step of a walk over the COUNT blocks starting at
+ * BLOCK_IDX, NULL if it is not cached. Short ranges look up each block,
+ * long ones check every buffer, I is below both COUNT and the number of
+ * buffers. Cache lock must be held.
+*/
+static struct cache_block *cache_range_buffer(struct block *d, uint32_t block_idx, uint32_t count, uint32_t i){
+	struct cache_block *b;
+
+	ASSERT(lock_held_by_current_thread(&cache_lock));
+
+	if(count <= cache_slots) return cache_lookup(d,block_idx + i);
+	b = &cache_blocks[i];
+	if(b->device != d || b->block_idx < block_idx || b->block_idx - block_idx >= count) return NULL;
+	return b;
+}
+/* Accepts the blocks of the struct cache_range AUX */
+static bool cache_filter_range(uint32_t block_idx, void *aux){
+	struct cache_range *range = aux;
+
+	return block_idx >= range->start && block_idx - range->start < range->count;
+}
+
+/* Choose a buffer to be reused, from the cold list or else with the
+ * CLOCK algorithm, cache lock must be held. The buffer returned is
+ * unused. A dirty victim is written with the cache lock released, so
+ * the caller must look up its block again afterwards.
+*/
+static struct cache_block *cache_evict(void){
+	struct cache_block *b = NULL;
+	uint32_t i;
+
+	ASSERT(lock_held_by_current_thread(&cache_lock));
+
+	while(b == NULL){
+		// Cold buffers accessed or borrowed since are left to CLOCK
+		while(b == NULL && !list_empty(&cache_cold)){
+			b = list_entry(list_pop_front(&cache_cold),struct cache_block,cold_elem);
+			b->cold = false;
+			if(b->ref_cnt > 0 || b->accessed) b = NULL;
+		}
+
+		// Two sweeps clear every reference bit at most once
+		for(i = 0; b == NULL && i < 2 * cache_slots; i++){
+			b = &cache_blocks[cache_hand];
+			cache_hand = (cache_hand + 1) % cache_slots;
+
+			if(b->ref_cnt > 0) b = NULL;
+			else if(b->accessed){
+				b->accessed = false;
+				b = NULL;
+			}
+		}
+		if(b == NULL) PANIC("Buffer cache: all %u buffers are in use.",cache_slots);
+
+		// Write a dirty victim back outside of the cache lock, like
+		// cache_flush_dirty(). It is used only if nobody took it meanwhile.
+		if(b->dirty){
+			b->dirty = false;
+			cache_dirty_cnt--;
+			b->writers++;
+			b->ref_cnt++;
+			lock_release(&cache_lock);
+
+			lock_acquire(&b->lock);
+			cache_write_device(b);
+			lock_release(&b->lock);
+
+			lock_acquire(&cache_lock);
+			b->writers--;
+			b->ref_cnt--;
+			if(b->ref_cnt > 0 || b->accessed || b->dirty) b = NULL;
+		}
+	}
+
+	// Victim found
+	if(b->cold){
+		list_remove(&b->cold_elem);
+		b->cold = false;
+	}
+	if(b->prefetched){
+		b->prefetched = false;
+		cache_ra_wasted++;
+	}
+	if(b->device != NULL) list_remove(&b->elem);
+	if(b->data == NULL) b->data = kmalloc(cache_block_size);
+	ASSERT(b->data != NULL);
+	b->device = NULL;
+	b->valid = false;
+	return b;
+}
+/* Buffer B borrowed unread has been filled, let other users in */
+static void cache_end_fill(struct cache_block *b){
+	if(!b->filling) return;
+	ASSERT(lock_held_by_current_thread(&b->lock));
+	b->filling = false;
+	b->valid = true;
+	lock_release(&b->lock);
+}
+/* Put buffer B on the cold list, cache lock must be held */
+static void cache_make_cold(struct cache_block *b){
+	ASSERT(lock_held_by_current_thread(&cache_lock));
+
+	if(!b->cold){
+		b->cold = true;
+		list_push_back(&cache_cold,&b->cold_elem);
+	}
+}
+
+/* Read buffer content from its device */
+static void cache_read_device(struct cache_block *b){
+	struct block_iovec iov = {b->data, cache_block_size};
+	uint32_t sectors = cache_block_size / BLOCK_SECTOR_SIZE;
+
+	block_readv(b->device,b->block_idx * sectors,&iov,1);
+}
+
+/* Write buffer content to its device */
+static void cache_write_device(struct cache_block *b){
+	cache_write_run(&b,1);
+}
+
+/* Write CNT buffers of consecutive blocks in one device request */
+static void cache_write_run(struct cache_block **run, uint32_t cnt){
+	struct block_iovec iov[CACHE_MAX_RUN];
+	uint32_t sectors = cache_block_size / BLOCK_SECTOR_SIZE;
+	uint32_t i;
+
+	ASSERT(cnt > 0 && cnt <= CACHE_MAX_RUN);
+
+	for(i = 0; i < cnt; i++){
+		ASSERT(run[i]->device == run[0]->device);
+		ASSERT(run[i]->block_idx == run[0]->block_idx + i);
+		iov[i].base = run[i]->data;
+		iov[i].len = cache_block_size;
+	}
+	block_writev(run[0]->device,run[0]->block_idx * sectors,iov,cnt);
+	cache_writes += cnt;
+}
+
+/* Write dirty buffers of device D (all devices if NULL) that became dirty
+ * before tick OLDER_THAN, in ascending block order. Only blocks FILTER
+ * accepts are written if it is not NULL.
+ * With SYNC set, buffers other flushes are writing are written again as
+ * they may not have reached the device yet.
+*/
+static void cache_flush_dirty(struct block *d, int64_t older_than, bool sync, cache_filter_func *filter, void *aux){
+	struct cache_block **dirty;
+	struct cache_block *b;
+	uint32_t i, j, run, cnt = 0;
+
+	// Collect and pin dirty buffers
+	lock_acquire(&cache_lock);
+	if(cache_dirty_cnt == 0 && !sync){
+		lock_release(&cache_lock);
+		return;
+	}
+	dirty = kmalloc((sync ? cache_slots : cache_dirty_cnt) * sizeof(struct cache_block*));
+	ASSERT(dirty != NULL);
+	for(i = 0; i < cache_slots; i++){
+		b = &cache_blocks[i];
+		if(b->device == NULL || (d != NULL && b->device != d)) continue;
+		if(b->dirty){
+			if(b->dirty_since >= older_than) continue;
+		}
+		else if(!sync || b->writers == 0) continue;
+		if(filter != NULL && !filter(b->block_idx,aux)) continue;
+		/* Clear the flag before writing, a buffer modified while it
+		 * is being written becomes dirty again. */
+		if(b->dirty){
+			b->dirty = false;
+			cache_dirty_cnt--;
+		}
+		b->writers++;
+		b->ref_cnt++;
+		dirty[cnt++] = b;
+	}
+	lock_release(&cache_lock);
+
+	// Write in ascending block order, consecutive blocks in one request
+	qsort(dirty,cnt,sizeof(struct cache_block*),cache_compare_block);
+	for(i = 0; i < cnt; i += run){
+		for(run = 1; i + run < cnt && run < CACHE_MAX_RUN; run++){
+			if(dirty[i+run]->device != dirty[i]->device) break;
+			if(dirty[i+run]->block_idx != dirty[i]->block_idx + run) break;
+		}
+		// Buffer locks are always taken in ascending block order
+		for(j = 0; j < run; j++) lock_acquire(&dirty[i+j]->lock);
+		cache_write_run(&dirty[i],run);
+		for(j = 0; j < run; j++) lock_release(&dirty[i+j]->lock);
+		lock_acquire(&cache_lock);
+		for(j = 0; j < run; j++){
+			dirty[i+j]->writers--;
+			dirty[i+j]->ref_cnt--;
+		}
+		lock_release(&cache_lock);
+	}
+	kfree(dirty);
+}
+
+static int cache_compare_block(const void *a, const void *b){
+	const struct cache_block *x = *(struct cache_block * const *)a;
+	const struct cache_block *y = *(struct cache_block * const *)b;
+
+	if(x->device != y->device) return (uintptr_t)x->device < (uintptr_t)y->device ? -1 : 1;
+	if(x->block_idx != y->block_idx) return x->block_idx < y->block_idx ? -1 : 1;
+	return 0;
+}
+
+/* Background flusher, writes aged dirty buffers and keeps
+ * the dirty ratio under its threshold.
+*/
+static void cache_flusher(void *aux UNUSED){
+	int64_t now, age;
+
+	while(!cache_flusher_stop){
+		timer_msleep(CACHE_FLUSH_PERIOD_MS);
+		if(!cache_write_back) continue;
+		if(cache_flush_hook != NULL) cache_flush_hook();
+
+		now = timer_ticks();
+		age = (int64_t)cache_dirty_age * TIMER_FREQ / 1000;
+		if(cache_dirty_cnt * 100 > cache_dirty_ratio * cache_slots)
+			cache_flush_dirty(NULL,INT64_MAX,false,NULL,NULL);
+		else
+			cache_flush_dirty(NULL,now - age + 1,false,NULL,NULL);
+	}
+	sema_up(&cache_flusher_done);
+}
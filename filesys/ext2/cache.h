@@ -0,0 +1,53 @@
+#ifndef EXT2_CACHE_H
+#define EXT2_CACHE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "devices/block.h"
+
+/* Memory budget of the block buffer cache, in bytes.
+ * The number of buffers is derived from the file system block size.
+*/
+#define CACHE_BUDGET (2*1024*1024)
+
+/* Default write-back policy. */
+#define CACHE_DIRTY_AGE_MS 3000		// write buffers dirty for longer than this
+#define CACHE_DIRTY_RATIO 50		// write all once this percent of buffers are dirty
+#define CACHE_FLUSH_PERIOD_MS 250	// flusher wake up period
+
+struct cache_block;
+
+/* Called before dirty buffers are written, to copy in-memory metadata
+ * into the cache.
+*/
+typedef void cache_flush_hook_func(void);
+
+/* Selects the blocks written by cache_flush_blocks() */
+typedef bool cache_filter_func(uint32_t block_idx, void *aux);
+
+// Alloc and Free
+void cache_init(uint32_t block_size);
+void cache_free(void);
+
+// Borrowing buffers
+struct cache_block *cache_get(struct block *d, uint32_t block_idx, bool read);
+struct cache_block *cache_find(struct block *d, uint32_t block_idx);
+void cache_prefetch(struct block *d, uint32_t block_idx, uint32_t count);
+void cache_discard(struct block *d, uint32_t block_idx, uint32_t count);
+void cache_drop(struct block *d, uint32_t block_idx, uint32_t count);
+void cache_demote(struct block *d, uint32_t block_idx, uint32_t count);
+void cache_put(struct cache_block *b);
+void *cache_data(struct cache_block *b);
+void cache_mark_dirty(struct cache_block *b);
+
+// Write-back
+void cache_flush(struct block *d);
+void cache_flush_blocks(struct block *d, cache_filter_func *filter, void *aux);
+void cache_set_write_back(bool enable);
+void cache_set_flush_policy(uint32_t age_ms, uint32_t dirty_ratio);
+void cache_set_flush_hook(cache_flush_hook_func *hook);
+
+// Statistics
+void cache_print_stats(void);
+
+#endif
@@ -0,0 +1,208 @@
+#include "filesys/ext2/dentry.h"
+#include "devices/block.h"
+#include "kernel/kmalloc.h"
+#include "kernel/synch.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <list.h>
+#include <debug.h>
+
+/*
+ * Directory entry cache.
+ * Maps (directory inode, name) to the inode and file type of the entry,
+ * so path resolution does not read every directory on the way.
+ * Names known to be absent are cached as negative entries with inode 0,
+ * so existence checks of new names do not read the directory either.
+ * The cache holds at most DENTRY_CACHE_SIZE entries, the least recently
+ * used one is dropped to make room. Negative entries have their own LRU
+ * list and are limited to DENTRY_NEGATIVE_MAX, a stream of lookups of new
+ * names cannot push out the positive entries.
+ * Entries are looked up by dir_lookup() and updated by filesys_create()
+ * and filesys_remove(). A lookup that read the directory only inserts its
+ * result if no entry was invalidated meanwhile, see dentry_generation().
+*/
+
+#define DENTRY_CACHE_BUCKETS 256
+#define DENTRY_CACHE_SIZE 1024 // entries kept cached
+#define DENTRY_NEGATIVE_MAX 512 // negative entries kept cached
+
+struct dentry {
+	struct block *device;
+	uint32_t parent;			// directory inode
+	uint32_t ino;				// inode of the entry, 0 if absent
+	uint8_t type;				// EXT2_FT_* type of the entry
+	uint8_t name_len;
+	struct list_elem elem;		// hash bucket element
+	struct list_elem lru_elem;	// LRU list element
+	char name[];				// NAME_LEN bytes, not terminated
+};
+
+static struct list dentry_buckets[DENTRY_CACHE_BUCKETS];
+static struct list dentry_lru; // positive entries, least recently used first
+static struct list dentry_neg_lru; // negative entries, least recently used first
+static uint32_t dentry_cnt;
+static uint32_t dentry_neg_cnt;
+static uint32_t dentry_gen; // bumped by every invalidation
+static struct lock dentry_lock;
+
+static uint32_t dentry_hash(struct block *d, uint32_t parent, const char *name, size_t len);
+static struct dentry *dentry_find(struct block *d, uint32_t parent, const char *name, size_t len);
+static void dentry_remove(struct dentry *e);
+static struct list *dentry_lru_list(struct dentry *e);
+
+/* Initialise the directory entry cache */
+void dentry_init(void){
+	int i;
+
+	lock_init(&dentry_lock);
+	for(i = 0; i < DENTRY_CACHE_BUCKETS; i++) list_init(&dentry_buckets[i]);
+	list_init(&dentry_lru);
+	list_init(&dentry_neg_lru);
+	dentry_cnt = 0;
+	dentry_neg_cnt = 0;
+	dentry_gen = 0;
+}
+/* Release every cached entry */
+void dentry_free(void){
+	lock_acquire(&dentry_lock);
+	while(!list_empty(&dentry_lru))
+		dentry_remove(list_entry(list_front(&dentry_lru),struct dentry,lru_elem));
+	while(!list_empty(&dentry_neg_lru))
+		dentry_remove(list_entry(list_front(&dentry_neg_lru),struct dentry,lru_elem));
+	lock_release(&dentry_lock);
+}
+
+/* Current invalidation generation. Callers reading a directory take it
+ * before the read and pass it to dentry_insert().
+*/
+uint32_t dentry_generation(void){
+	uint32_t gen;
+
+	lock_acquire(&dentry_lock);
+	gen = dentry_gen;
+	lock_release(&dentry_lock);
+	return gen;
+}
+/* Look up NAME of LEN bytes in directory PARENT of device D.
+ * Returns true and sets INO and TYPE on a hit, INO is 0 if the name is
+ * known to be absent.
+*/
+bool dentry_lookup(struct block *d, uint32_t parent, const char *name, size_t len, uint32_t *ino, uint8_t *type){
+	struct dentry *e;
+
+	ASSERT(d != NULL && name != NULL && ino != NULL && type != NULL);
+
+	lock_acquire(&dentry_lock);
+	e = dentry_find(d,parent,name,len);
+	if(e != NULL){
+		// Most recently used goes last
+		list_remove(&e->lru_elem);
+		list_push_back(dentry_lru_list(e),&e->lru_elem);
+		*ino = e->ino;
+		*type = e->type;
+	}
+	lock_release(&dentry_lock);
+
+	return e != NULL;
+}
+/* Cache entry NAME of directory PARENT, which is inode INO of TYPE,
+ * or absent if INO is 0.
+ * Nothing is cached if an entry was invalidated since generation GEN.
+*/
+void dentry_insert(struct block *d, uint32_t parent, const char *name, size_t len, uint32_t ino, uint8_t type, uint32_t gen){
+	struct dentry *e;
+
+	ASSERT(d != NULL && name != NULL);
+	if(len == 0 || len > UINT8_MAX) return;
+
+	lock_acquire(&dentry_lock);
+	if(gen != dentry_gen){
+		lock_release(&dentry_lock);
+		return;
+	}
+	// Replace an existing entry, it may change between the lists
+	e = dentry_find(d,parent,name,len);
+	if(e != NULL) dentry_remove(e);
+
+	// Make room
+	if(ino == 0 && dentry_neg_cnt >= DENTRY_NEGATIVE_MAX)
+		dentry_remove(list_entry(list_front(&dentry_neg_lru),struct dentry,lru_elem));
+	else if(dentry_cnt >= DENTRY_CACHE_SIZE){
+		if(!list_empty(&dentry_neg_lru) && (ino == 0 || list_empty(&dentry_lru)))
+			dentry_remove(list_entry(list_front(&dentry_neg_lru),struct dentry,lru_elem));
+		else
+			dentry_remove(list_entry(list_front(&dentry_lru),struct dentry,lru_elem));
+	}
+
+	e = kmalloc(sizeof(struct dentry) + len);
+	if(e != NULL){
+		e->device = d;
+		e->parent = parent;
+		e->ino = ino;
+		e->type = type;
+		e->name_len = len;
+		memcpy(e->name,name,len);
+		list_push_front(&dentry_buckets[dentry_hash(d,parent,name,len)],&e->elem);
+		list_push_back(dentry_lru_list(e),&e->lru_elem);
+		dentry_cnt++;
+		if(ino == 0) dentry_neg_cnt++;
+	}
+	lock_release(&dentry_lock);
+}
+/* Entry NAME of directory PARENT changed, forget it */
+void dentry_invalidate(struct block *d, uint32_t parent, const char *name, size_t len){
+	struct dentry *e;
+
+	ASSERT(d != NULL && name != NULL);
+
+	lock_acquire(&dentry_lock);
+	dentry_gen++;
+	e = dentry_find(d,parent,name,len);
+	if(e != NULL) dentry_remove(e);
+	lock_release(&dentry_lock);
+}
+
+/* FNV-1a hash of the entry key */
+static uint32_t dentry_hash(struct block *d, uint32_t parent, const char *name, size_t len){
+	uint32_t h = 2166136261u;
+	size_t i;
+
+	h = (h ^ (uint32_t)(uintptr_t)d) * 16777619u;
+	h = (h ^ parent) * 16777619u;
+	for(i = 0; i < len; i++)
+		h = (h ^ (uint8_t)name[i]) * 16777619u;
+	return h % DENTRY_CACHE_BUCKETS;
+}
+/* Find a cached entry, cache lock must be held */
+static struct dentry *dentry_find(struct block *d, uint32_t parent, const char *name, size_t len){
+	struct list *bucket = &dentry_buckets[dentry_hash(d,parent,name,len)];
+	struct list_elem *e;
+	struct dentry *entry;
+
+	ASSERT(lock_held_by_current_thread(&dentry_lock));
+
+	for(e = list_begin(bucket); e != list_end(bucket); e = list_next(e)){
+		entry = list_entry(e,struct dentry,elem);
+		if(entry->device == d && entry->parent == parent && entry->name_len == len
+			&& memcmp(entry->name,name,len) == 0)
+			return entry;
+	}
+	return NULL;
+}
+/* Drop cached entry E, cache lock must be held */
+static void dentry_remove(struct dentry *e){
+	ASSERT(lock_held_by_current_thread(&dentry_lock));
+
+	list_remove(&e->elem);
+	list_remove(&e->lru_elem);
+	dentry_cnt--;
+	if(e->ino == 0) dentry_neg_cnt--;
+	kfree(e);
+}
+/* LRU list of entry E */
+static struct list *dentry_lru_list(struct dentry *e){
+	return e->ino == 0 ? &dentry_neg_lru : &dentry_lru;
+}
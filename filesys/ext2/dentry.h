@@ -0,0 +1,19 @@
+#ifndef EXT2_DENTRY_H
+#define EXT2_DENTRY_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "devices/block.h"
+
+// Alloc and Free
+void dentry_init(void);
+void dentry_free(void);
+
+// Lookup and update
+uint32_t dentry_generation(void);
+bool dentry_lookup(struct block *d, uint32_t parent, const char *name, size_t len, uint32_t *ino, uint8_t *type);
+void dentry_insert(struct block *d, uint32_t parent, const char *name, size_t len, uint32_t ino, uint8_t type, uint32_t gen);
+void dentry_invalidate(struct block *d, uint32_t parent, const char *name, size_t len);
+
+#endif
@@ -1,111 +1,807 @@
 #include "filesys/ext2/directory.h"
+#include "filesys/directory.h"
+#include "filesys/filesys.h"
+#include "filesys/file.h"
 #include "filesys/ext2/inode.h"
 #include "filesys/ext2/ext2.h"
+#include "filesys/ext2/dentry.h"
+#include "filesys/ext2/htree.h"
 #include "devices/block.h"
 #include "kernel/kmalloc.h"
+#include "kernel/synch.h"
 
+#include <stddef.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <string.h>
 #include <debug.h>
+#include <round.h>
+#include <bitmap.h>
+#include <list.h>
 
-static struct directory *dir_get_root(struct block *d);
-static struct directory *dir_lookup_current(struct directory *cur, const char *file_name);
+#define DIR_HEADER offsetof(struct directory,name) // entry bytes before the name
+#define DIR_ITER_BATCH 8 // directory blocks mapped and prefetched at once
+#define DIR_SLOTS_MAX 16 // directories with a free slot index
+#define DIR_SLOT_CLASSES 6 // gaps of 12-15, 16-31, ... 128-255 and 256+ bytes
+#define DIR_RECORD_LEN(len) ROUND_UP(offsetof(struct dir_record,name) + (len) + 1, 4)
 
+/* Open directory, read with dir_readdir_batch().
+ * The file position is the byte offset of the next entry.
+*/
+struct dir {
+	struct file *file;
+};
+
+/* Free slot index of a linear directory.
+ * Removed entries leave gaps, merged into the entry before them, that
+ * new entries can reuse. The index keeps the largest gap of every block
+ * and a bitmap of blocks per size class of that gap, so an insert finds
+ * the first block where it fits without reading the directory.
+ * It is built by the first insert and kept up to date under the directory
+ * inode lock by dir_add_entry() and dir_remove_entry().
+*/
+struct dir_slots {
+	struct block *device;
+	uint32_t ino;				// directory inode
+	int users;					// dir_slots_get() calls not yet put
+	bool stale;					// freed once unused
+	uint32_t blocks;			// blocks described
+	uint32_t capacity;			// blocks GAP and CLASSES have room for
+	uint32_t *gap;				// largest reusable gap of each block
+	struct bitmap *classes[DIR_SLOT_CLASSES];	// blocks by size class of their gap
+	struct list_elem elem;		// dir_slots_list element
+};
+
+static struct list dir_slots_list; // most recently used first
+static uint32_t dir_slots_cnt;
+static struct lock dir_slots_lock;
+
+static int dir_find(struct block *d, uint32_t dir_ino, const char *name, size_t len, struct directory *entry);
+static void dir_set_entry(struct directory *entry, uint32_t ino, uint8_t type, const char *name, size_t len);
+static bool dir_has_entry(struct block *d, struct inode *dir, const char *name, size_t len);
+static uint32_t dir_block_gap(void *data, uint32_t block_size);
+static struct dir_slots *dir_slots_get(struct block *d, uint32_t dir_ino, struct inode *dir, bool build);
+static void dir_slots_put(struct dir_slots *s);
+static void dir_slots_free(struct dir_slots *s);
+static bool dir_slots_build(struct dir_slots *s, struct inode *dir);
+static bool dir_slots_set(struct dir_slots *s, uint32_t logical, uint32_t gap);
+static uint32_t dir_slots_find(struct dir_slots *s, uint32_t need);
+static int dir_slot_class(uint32_t gap);
+
+/* Initialise the free slot indexes */
+void dir_init(void){
+	lock_init(&dir_slots_lock);
+	list_init(&dir_slots_list);
+	dir_slots_cnt = 0;
+}
+/* Release every free slot index */
+void dir_free(void){
+	struct dir_slots *s;
+
+	lock_acquire(&dir_slots_lock);
+	while(!list_empty(&dir_slots_list)){
+		s = list_entry(list_pop_front(&dir_slots_list),struct dir_slots,elem);
+		ASSERT(s->users == 0);
+		dir_slots_free(s);
+	}
+	dir_slots_cnt = 0;
+	lock_release(&dir_slots_lock);
+}
+
+/* Resolve PATH from the root directory. Each component is looked up in
+ * the directory entry cache first, the directory is only read on a miss.
+ * Missing names are cached too, see dentry.c.
+ * Returns a copy of the entry the caller must free, NULL if not found.
+*/
 struct directory *dir_lookup(struct block *d, const char *path){
 	char *path_copy, *token, *save_ptr;
-	struct directory *cur,*next,*last,*file_ptr;
+	struct directory entry;
 	struct directory *found = NULL;
+	uint32_t parent, ino, gen;
+	uint8_t type;
+	size_t len;
+	int err;
 
 	ASSERT(path != NULL);
 
 	// copy path
 	path_copy = kmalloc(strlen(path)+1);
+	if(path_copy == NULL) return NULL;
 	memcpy(path_copy,path,strlen(path)+1);
-	
+
 	// start from root
-	last = NULL;
-	cur = dir_get_root(d);
-	ASSERT(cur != NULL);
+	dir_set_entry(&entry,EXT2_ROOT_INO,EXT2_FT_DIR,"/",1);
 
 	// search path
 	for(token = strtok_r(path_copy,"/",&save_ptr); token != NULL;
 		token = strtok_r(NULL,"/",&save_ptr)){
-		// check if current directory is the same as the last
-		if(cur == last) {
-			file_ptr = NULL;
+		// only directories have entries
+		if(entry.file_type != EXT2_FT_DIR){
+			entry.inode = 0;
 			break;
 		}
+		parent = entry.inode;
+		len = strlen(token);
 
-		// look up current directory
-		file_ptr = dir_lookup_current(cur,token);
-		last = cur; //save current directory
-
-		// if file is directory
-		if(file_ptr != NULL && file_ptr->inode != 0 && file_ptr->file_type == EXT2_FT_DIR){
-			// get file inode, it is temporary
-			struct inode *file_ino = ext2_get_inode(d,file_ptr->inode);
-			if(file_ino == NULL || (file_ino->i_mode & EXT2_S_IFDIR) == 0){
-				file_ptr = NULL;
-				if(file_ino != NULL) kfree(file_ino);
-				break;
-			}
-
-			// read directory file
-			next = kmalloc(file_ino->i_size);
-			if(next == NULL) {
-				file_ptr = NULL;
-				kfree(file_ino);
+		// look up cached entry
+		if(dentry_lookup(d,parent,token,len,&ino,&type)){
+			if(ino == 0){
+				entry.inode = 0;
 				break;
 			}
-			inode_read_at(d,file_ino,next,file_ino->i_size,0);		
+			dir_set_entry(&entry,ino,type,token,len);
+			continue;
+		}
 
-			// free temporary memory and switch directory
-			kfree(file_ino);
-			kfree(cur);
-			cur = next;
+		// read directory, cache the result
+		gen = dentry_generation();
+		err = dir_find(d,parent,token,len,&entry);
+		if(err == 0)
+			dentry_insert(d,parent,token,len,entry.inode,entry.file_type,gen);
+		else{
+			// only cache names missing from a directory that was read
+			if(err == DIR_NOT_FOUND) dentry_insert(d,parent,token,len,0,EXT2_FT_UNKNOWN,gen);
+			entry.inode = 0;
+			break;
 		}
 	}
 
 	// file found
-	if(file_ptr != NULL && file_ptr->inode != 0){
+	if(entry.inode != 0){
 		found = kmalloc(sizeof(struct directory));
-		memcpy(found,file_ptr,sizeof(struct directory));
+		if(found != NULL) memcpy(found,&entry,sizeof(struct directory));
 	}
-	
-	kfree(cur);
+
 	kfree(path_copy);
 	return found;
 }
 
-static struct directory *dir_lookup_current(struct directory *cur, const char *file_name){
-	struct directory *next = cur;
+/* Open directory PATH for reading its entries */
+struct dir *dir_open(const char *path){
+	struct dir *dir;
+	struct file *file;
 
-	ASSERT(cur != NULL);
-	
-	while(next != NULL && next->inode != 0){
-		if(memcmp (next->name,file_name,next->name_len) == 0) return next;
-		next = dir_get_next(next);
+	ASSERT(path != NULL);
+
+	file = filesys_open(path);
+	if(file == NULL) return NULL;
+	if(file->dir->file_type != EXT2_FT_DIR){
+		file_close(file);
+		return NULL;
+	}
+
+	dir = kmalloc(sizeof(struct dir));
+	if(dir == NULL){
+		file_close(file);
+		return NULL;
+	}
+	dir->file = file;
+	return dir;
+}
+/* Close directory DIR */
+void dir_close(struct dir *dir){
+	if(dir != NULL){
+		file_close(dir->file);
+		kfree(dir);
+	}
+}
+/* Fill BUFFER of SIZE bytes with the records, see struct dir_record, of
+ * as many entries of DIR as fit, starting at its position. Entries are
+ * read block by block through the buffer cache, in the order they are
+ * stored. The position moves past the entries returned, it stays valid
+ * while entries are added and removed; a cookie in the middle of a
+ * removed entry resumes at the entry after it.
+ * Returns the number of bytes filled, 0 at the end of the directory and
+ * -1 if the next record does not fit in SIZE bytes.
+*/
+int dir_readdir_batch(struct dir *dir, void *buffer, size_t size){
+	struct ext2_meta_data *meta;
+	struct inode *inode;
+	struct directory *cur;
+	struct dir_record *rec;
+	struct dir_iter it;
+	uint8_t *data;
+	uint32_t block_size, pos, start, len;
+	size_t filled = 0;
+	bool full = false;
+
+	ASSERT(dir != NULL && buffer != NULL);
+
+	meta = ext2_get_meta(dir->file->device);
+	ASSERT(meta != NULL && meta->sb != NULL);
+	block_size = ext2_get_block_size(meta->sb);
+
+	lock_acquire(&dir->file->lock);
+	inode = dir->file->inode;
+	inode_lock_shared(inode);
+
+	dir_iter_init(&it,dir->file->device,inode,dir->file->pos / block_size);
+	while(!full && (data = dir_iter_next(&it)) != NULL){
+		// resume at the first entry at or after the cookie
+		start = 0;
+		if((off_t)(it.logical * it.block_size) < dir->file->pos)
+			start = dir->file->pos % it.block_size;
+
+		for(pos = 0; pos + DIR_HEADER <= it.block_size; pos += cur->rec_len){
+			cur = (struct directory*)(data + pos);
+			if(cur->rec_len < DIR_HEADER || pos + cur->rec_len > it.block_size) break;
+			if(pos < start) continue;
+
+			if(cur->inode != 0 && cur->name_len > 0){
+				len = DIR_RECORD_LEN(cur->name_len);
+				if(filled + len > size){
+					full = true;
+					break;
+				}
+				rec = (struct dir_record*)((uint8_t*)buffer + filled);
+				rec->inode = cur->inode;
+				rec->rec_len = len;
+				rec->name_len = cur->name_len;
+				rec->file_type = cur->file_type;
+				memcpy(rec->name,cur->name,cur->name_len);
+				rec->name[cur->name_len] = '\0';
+				filled += len;
+			}
+			dir->file->pos = (off_t)it.logical * it.block_size + pos + cur->rec_len;
+		}
+		// block done
+		if(!full) dir->file->pos = (off_t)(it.logical + 1) * it.block_size;
+	}
+	if(!full && dir->file->pos < (off_t)inode->i_size) dir->file->pos = inode->i_size;
+	dir_iter_done(&it);
+
+	inode_unlock_shared(inode);
+	lock_release(&dir->file->lock);
+
+	if(full && filled == 0) return -1;
+	return filled;
+}
+/* Move the position of DIR to COOKIE, a position from dir_tell() or 0 */
+void dir_seek(struct dir *dir, off_t cookie){
+	ASSERT(dir != NULL && cookie >= 0);
+	file_seek(dir->file,cookie);
+}
+/* Position of DIR */
+off_t dir_tell(struct dir *dir){
+	ASSERT(dir != NULL);
+	return file_tell(dir->file);
+}
+
+/* Find entry NAME of LEN bytes in directory inode DIR_INO and copy it
+ * to ENTRY. Returns 0 on success, DIR_NOT_FOUND if there is no such entry
+ * and -1 if the directory could not be read.
+*/
+static int dir_find(struct block *d, uint32_t dir_ino, const char *name, size_t len, struct directory *entry){
+	struct inode *dir_inode;
+	struct directory *cur = NULL;
+	struct dir_iter it;
+	void *data;
+	int err;
+
+	ASSERT(d != NULL && name != NULL && entry != NULL);
+	if(len == 0 || len > UINT8_MAX) return DIR_NOT_FOUND;
+
+	dir_inode = ext2_get_inode(d,dir_ino);
+	if(dir_inode == NULL) return -1;
+	if((dir_inode->i_mode & EXT2_S_IFDIR) == 0){
+		ext2_put_inode(d,dir_inode);
+		return -1;
+	}
+
+	// use the hash index, scan the whole directory if it is unusable
+	err = htree_find(d,dir_inode,name,len,entry);
+	if(err >= 0){
+		ext2_put_inode(d,dir_inode);
+		return err;
+	}
+
+	// scan block by block, entries never cross a block boundary
+	inode_lock_shared(dir_inode);
+	dir_iter_init(&it,d,dir_inode,0);
+	while(cur == NULL && (data = dir_iter_next(&it)) != NULL)
+		cur = dir_find_in_block(data,it.block_size,name,len);
+	if(cur != NULL) dir_set_entry(entry,cur->inode,cur->file_type,name,len);
+	dir_iter_done(&it);
+	inode_unlock_shared(dir_inode);
+
+	ext2_put_inode(d,dir_inode);
+	return cur != NULL ? 0 : DIR_NOT_FOUND;
+}
+
+/* Whether directory DIR without an index, locked by the caller, has
+ * entry NAME of LEN bytes
+*/
+static bool dir_has_entry(struct block *d, struct inode *dir, const char *name, size_t len){
+	struct directory *cur = NULL;
+	struct dir_iter it;
+	void *data;
+
+	dir_iter_init(&it,d,dir,0);
+	while(cur == NULL && (data = dir_iter_next(&it)) != NULL)
+		cur = dir_find_in_block(data,it.block_size,name,len);
+	dir_iter_done(&it);
+
+	return cur != NULL;
+}
+
+/* Start a scan of directory DIR of device D at its block FIRST */
+void dir_iter_init(struct dir_iter *it, struct block *d, struct inode *dir, uint32_t first){
+	struct ext2_meta_data *meta;
+
+	ASSERT(it != NULL && d != NULL && dir != NULL);
+
+	meta = ext2_get_meta(d);
+	ASSERT(meta != NULL && meta->sb != NULL);
+
+	it->device = d;
+	it->dir = dir;
+	it->block_size = ext2_get_block_size(meta->sb);
+	it->blocks = dir->i_size / it->block_size;
+	it->logical = first;
+	it->next = first;
+	it->extent.logical = 0;
+	it->extent.length = 0;
+	it->b = NULL;
+}
+/* Release the block being visited and move to the next allocated one.
+ * Blocks are mapped DIR_ITER_BATCH at a time and prefetched, so a long
+ * scan reads the directory in runs while a hit early reads little.
+ * Returns the data of the block, NULL once the directory is done.
+*/
+void *dir_iter_next(struct dir_iter *it){
+	uint32_t count;
+
+	ASSERT(it != NULL);
+
+	if(it->b != NULL){
+		cache_put(it->b);
+		it->b = NULL;
+	}
+
+	while(it->next < it->blocks){
+		// map the next batch
+		if(it->next < it->extent.logical || it->next >= it->extent.logical + it->extent.length){
+			count = it->blocks - it->next;
+			if(count > DIR_ITER_BATCH) count = DIR_ITER_BATCH;
+			if(inode_map_range(it->device,it->dir,it->next,count,&it->extent,1) != 1) return NULL;
+			if(it->extent.physical != 0)
+				cache_prefetch(it->device,it->extent.physical,it->extent.length);
+		}
+
+		it->logical = it->next++;
+		// holes have no entries
+		if(it->extent.physical == 0) continue;
+		it->b = cache_get(it->device,it->extent.physical + (it->logical - it->extent.logical),true);
+		return cache_data(it->b);
 	}
 	return NULL;
 }
+/* The block being visited was modified */
+void dir_iter_mark_dirty(struct dir_iter *it){
+	ASSERT(it != NULL && it->b != NULL);
+	cache_mark_dirty(it->b);
+}
+/* End the scan */
+void dir_iter_done(struct dir_iter *it){
+	ASSERT(it != NULL);
+	if(it->b != NULL) cache_put(it->b);
+	it->b = NULL;
+}
+
+/* Add entry NAME of LEN bytes for inode INO of TYPE to directory DIR,
+ * inode DIR_INO. Only the directory block receiving the entry is modified:
+ * the leaf of its hash in an indexed directory, else the first block with
+ * a large enough gap, see struct dir_slots, or a new one appended when
+ * there is none. A full one block directory gets an index instead, like
+ * in Linux. Returns 0 on success, -1 on failure.
+*/
+int dir_add_entry(struct block *d, uint32_t dir_ino, struct inode *dir, const char *name, size_t len, uint32_t ino, uint8_t type){
+	struct ext2_meta_data *meta;
+	struct dir_slots *slots;
+	struct cache_block *b;
+	struct dir_iter it;
+	uint32_t block_size, blocks, logical;
+	void *data;
+	bool added = false;
 
-static struct directory *dir_get_root(struct block *d){
-	struct inode *root_ino;
-	struct directory *root;
+	ASSERT(d != NULL && dir != NULL && name != NULL);
+	if(len == 0 || len > UINT8_MAX) return -1;
 
-	ASSERT(d != NULL);
+	meta = ext2_get_meta(d);
+	ASSERT(meta != NULL && meta->sb != NULL);
+	block_size = ext2_get_block_size(meta->sb);
 
-	// get root inode
-	root_ino = ext2_get_inode(d,EXT2_ROOT_INO);
+	if(htree_indexed(d,dir))
+		return htree_add_entry(d,dir_ino,dir,name,len,ino,type);
 
-	// allocate memory
-	root = kmalloc(root_ino->i_size);
-	if(root == NULL) return NULL;
+	inode_lock(dir);
+	// indexed by another thread since the check above
+	if(htree_indexed(d,dir)){
+		inode_unlock(dir);
+		return htree_add_entry(d,dir_ino,dir,name,len,ino,type);
+	}
+	// names are unique, checked under the lock against concurrent adds
+	if(dir_has_entry(d,dir,name,len)){
+		inode_unlock(dir);
+		return -1;
+	}
+	blocks = dir->i_size / block_size;
 
-	// read entire file
-	inode_read_at(d,root_ino,root,root_ino->i_size,0);
+	// first block with a gap large enough, the last block without an index
+	slots = dir_slots_get(d,dir_ino,dir,true);
+	if(slots != NULL) logical = dir_slots_find(slots,DIR_ENTRY_LEN(len));
+	else logical = blocks > 0 ? blocks - 1 : UINT32_MAX;
+	if(logical != UINT32_MAX){
+		dir_iter_init(&it,d,dir,logical);
+		data = dir_iter_next(&it);
+		if(data != NULL && it.logical == logical)
+			added = dir_insert_in_block(data,block_size,name,len,ino,type);
+		if(added){
+			dir_iter_mark_dirty(&it);
+			if(slots != NULL && !dir_slots_set(slots,logical,dir_block_gap(data,block_size)))
+				slots->stale = true;
+		}
+		dir_iter_done(&it);
+	}
+
+	// a full one block directory gets an index like in Linux
+	if(!added && blocks == 1 && htree_can_index(d,dir)){
+		if(slots != NULL) slots->stale = true;
+		dir_slots_put(slots);
+		inode_unlock(dir);
+		// another thread may index or grow it once the lock is dropped
+		if(htree_create(d,dir_ino,dir) == 0 || htree_indexed(d,dir))
+			return htree_add_entry(d,dir_ino,dir,name,len,ino,type);
+		if(dir->i_size != block_size)
+			return dir_add_entry(d,dir_ino,dir,name,len,ino,type);
+		return -1;
+	}
+
+	// no room anywhere, add a block
+	if(!added){
+		b = dir_append_block(d,dir_ino,dir,&logical);
+		if(b != NULL){
+			added = dir_insert_in_block(cache_data(b),block_size,name,len,ino,type);
+			if(added) cache_mark_dirty(b);
+			if(slots != NULL && !dir_slots_set(slots,logical,dir_block_gap(cache_data(b),block_size)))
+				slots->stale = true;
+			cache_put(b);
+		}
+		else if(slots != NULL) slots->stale = true;
+	}
+	dir_slots_put(slots);
+	inode_unlock(dir);
+	return added ? 0 : -1;
+}
+/* Remove entry NAME of LEN bytes from directory DIR, inode DIR_INO, and
+ * store its inode in INO. Only the directory block holding the entry is
+ * modified, its gap is recorded if the directory has a free slot index.
+ * Returns 0 on success, DIR_NOT_FOUND if there is no such entry.
+*/
+int dir_remove_entry(struct block *d, uint32_t dir_ino, struct inode *dir, const char *name, size_t len, uint32_t *ino){
+	struct dir_slots *slots;
+	struct dir_iter it;
+	void *data;
+	bool found = false;
+	int err;
+
+	ASSERT(d != NULL && dir != NULL && name != NULL);
+	if(len == 0 || len > UINT8_MAX) return DIR_NOT_FOUND;
+
+	// use the hash index, scan the whole directory if it is unusable
+	if(htree_indexed(d,dir)){
+		err = htree_remove_entry(d,dir,name,len,ino);
+		if(err >= 0) return err;
+	}
+
+	inode_lock(dir);
+	slots = dir_slots_get(d,dir_ino,dir,false);
+	dir_iter_init(&it,d,dir,0);
+	while(!found && (data = dir_iter_next(&it)) != NULL){
+		found = dir_remove_in_block(data,it.block_size,name,len,ino);
+		if(!found) continue;
+		dir_iter_mark_dirty(&it);
+		if(slots != NULL && !dir_slots_set(slots,it.logical,dir_block_gap(data,it.block_size)))
+			slots->stale = true;
+	}
+	dir_iter_done(&it);
+	dir_slots_put(slots);
+	inode_unlock(dir);
+
+	return found ? 0 : DIR_NOT_FOUND;
+}
+/* Append an empty block to directory DIR, inode DIR_INO, and borrow it.
+ * Its number is stored in LOGICAL. The caller holds the directory inode
+ * lock. Returns NULL on failure.
+*/
+struct cache_block *dir_append_block(struct block *d, uint32_t dir_ino, struct inode *dir, uint32_t *logical){
+	struct ext2_meta_data *meta;
+	struct inode_extent extent;
+	struct cache_block *b;
+	struct directory *empty;
+	uint32_t block_size;
+
+	ASSERT(d != NULL && dir != NULL && logical != NULL);
+
+	meta = ext2_get_meta(d);
+	ASSERT(meta != NULL && meta->sb != NULL);
+	block_size = ext2_get_block_size(meta->sb);
+
+	*logical = dir->i_size / block_size;
+	if(inode_resize(dir_ino,dir,dir->i_size + block_size) < 0) return NULL;
+	inode_mark_dirty(dir);
+	if(inode_map_range(d,dir,*logical,1,&extent,1) != 1 || extent.physical == 0) return NULL;
+
+	// a new block is not read, one unused entry spans it
+	b = cache_get(d,extent.physical,false);
+	memset(cache_data(b),0,block_size);
+	empty = cache_data(b);
+	empty->rec_len = block_size;
+	cache_mark_dirty(b);
+	return b;
+}
+
+/* Largest gap of directory block DATA a new entry can use */
+static uint32_t dir_block_gap(void *data, uint32_t block_size){
+	struct directory *cur;
+	uint32_t pos, used, gap = 0;
+
+	for(pos = 0; pos + DIR_HEADER <= block_size; pos += cur->rec_len){
+		cur = (struct directory*)((uint8_t*)data + pos);
+		if(cur->rec_len < DIR_HEADER || pos + cur->rec_len > block_size) break;
+		used = cur->inode != 0 ? DIR_ENTRY_LEN(cur->name_len) : 0;
+		if(cur->rec_len > used && cur->rec_len - used > gap) gap = cur->rec_len - used;
+	}
+	return gap;
+}
+/* Free slot index of directory DIR, inode DIR_INO, built now with BUILD
+ * if there is none. The caller holds the directory inode lock until
+ * dir_slots_put(). Returns NULL if there is no index.
+*/
+static struct dir_slots *dir_slots_get(struct block *d, uint32_t dir_ino, struct inode *dir, bool build){
+	struct list_elem *e;
+	struct dir_slots *s = NULL, *victim;
+
+	lock_acquire(&dir_slots_lock);
+	for(e = list_begin(&dir_slots_list); e != list_end(&dir_slots_list); e = list_next(e)){
+		s = list_entry(e,struct dir_slots,elem);
+		if(s->device == d && s->ino == dir_ino) break;
+		s = NULL;
+	}
+	// a stale index is rebuilt
+	if(s != NULL && s->stale && s->users == 0){
+		list_remove(&s->elem);
+		dir_slots_cnt--;
+		dir_slots_free(s);
+		s = NULL;
+	}
+	if(s != NULL){
+		// most recently used goes first
+		list_remove(&s->elem);
+		list_push_front(&dir_slots_list,&s->elem);
+		s->users++;
+	}
+	lock_release(&dir_slots_lock);
+	if(s != NULL || !build) return s;
+
+	// index the directory, without holding the list lock while reading it
+	s = kmalloc(sizeof(struct dir_slots));
+	if(s == NULL) return NULL;
+	memset(s,0,sizeof(struct dir_slots));
+	s->device = d;
+	s->ino = dir_ino;
+	s->users = 1;
+	if(!dir_slots_build(s,dir)){
+		dir_slots_free(s);
+		return NULL;
+	}
+
+	lock_acquire(&dir_slots_lock);
+	// make room, indexes in use stay
+	for(e = list_rbegin(&dir_slots_list); dir_slots_cnt >= DIR_SLOTS_MAX && e != list_rend(&dir_slots_list); ){
+		victim = list_entry(e,struct dir_slots,elem);
+		e = list_prev(e);
+		if(victim->users > 0) continue;
+		list_remove(&victim->elem);
+		dir_slots_cnt--;
+		dir_slots_free(victim);
+	}
+	list_push_front(&dir_slots_list,&s->elem);
+	dir_slots_cnt++;
+	lock_release(&dir_slots_lock);
+	return s;
+}
+/* Done with index S, which may be NULL */
+static void dir_slots_put(struct dir_slots *s){
+	if(s == NULL) return;
+
+	lock_acquire(&dir_slots_lock);
+	ASSERT(s->users > 0);
+	s->users--;
+	if(s->stale && s->users == 0){
+		list_remove(&s->elem);
+		dir_slots_cnt--;
+		dir_slots_free(s);
+	}
+	lock_release(&dir_slots_lock);
+}
+/* Release the memory of index S */
+static void dir_slots_free(struct dir_slots *s){
+	int i;
+
+	if(s->gap != NULL) kfree(s->gap);
+	for(i = 0; i < DIR_SLOT_CLASSES; i++)
+		if(s->classes[i] != NULL) bitmap_destroy(s->classes[i]);
+	kfree(s);
+}
+/* Record the gap of every block of directory DIR in S.
+ * Returns false if out of memory.
+*/
+static bool dir_slots_build(struct dir_slots *s, struct inode *dir){
+	struct dir_iter it;
+	void *data;
+	bool success = true;
+
+	dir_iter_init(&it,s->device,dir,0);
+	while(success && (data = dir_iter_next(&it)) != NULL)
+		success = dir_slots_set(s,it.logical,dir_block_gap(data,it.block_size));
+	dir_iter_done(&it);
+
+	// holes and trailing blocks have no gap
+	if(success && it.blocks > 0 && s->blocks < it.blocks)
+		success = dir_slots_set(s,it.blocks - 1,0);
+	return success;
+}
+/* Record GAP bytes as the largest gap of block LOGICAL in S, the index
+ * grows to cover it. Returns false if out of memory.
+*/
+static bool dir_slots_set(struct dir_slots *s, uint32_t logical, uint32_t gap){
+	struct bitmap *classes[DIR_SLOT_CLASSES];
+	uint32_t *gaps;
+	uint32_t capacity, idx;
+	int i, class;
+
+	// grow by doubling, gaps of new blocks are 0
+	if(logical >= s->capacity){
+		capacity = s->capacity > 0 ? s->capacity : 64;
+		while(capacity <= logical) capacity *= 2;
+		gaps = kmalloc(capacity * sizeof(uint32_t));
+		for(i = 0; i < DIR_SLOT_CLASSES; i++) classes[i] = bitmap_create(capacity);
+		for(i = 0; i < DIR_SLOT_CLASSES && gaps != NULL && classes[i] != NULL; i++);
+		if(i < DIR_SLOT_CLASSES){
+			if(gaps != NULL) kfree(gaps);
+			for(i = 0; i < DIR_SLOT_CLASSES; i++)
+				if(classes[i] != NULL) bitmap_destroy(classes[i]);
+			return false;
+		}
+		memset(gaps,0,capacity * sizeof(uint32_t));
+		if(s->gap != NULL){
+			memcpy(gaps,s->gap,s->blocks * sizeof(uint32_t));
+			kfree(s->gap);
+		}
+		for(i = 0; i < DIR_SLOT_CLASSES; i++){
+			if(s->classes[i] == NULL) continue;
+			for(idx = bitmap_scan(s->classes[i],0,1,true); idx != BITMAP_ERROR && idx < s->blocks;
+				idx = bitmap_scan(s->classes[i],idx+1,1,true))
+				bitmap_set(classes[i],idx,true);
+			bitmap_destroy(s->classes[i]);
+		}
+		s->gap = gaps;
+		memcpy(s->classes,classes,sizeof(classes));
+		s->capacity = capacity;
+	}
+	if(logical >= s->blocks) s->blocks = logical + 1;
+
+	// move the block to the class of its new gap
+	class = dir_slot_class(s->gap[logical]);
+	if(class >= 0) bitmap_set(s->classes[class],logical,false);
+	s->gap[logical] = gap;
+	class = dir_slot_class(gap);
+	if(class >= 0) bitmap_set(s->classes[class],logical,true);
+	return true;
+}
+/* First block of S with a gap of NEED bytes, UINT32_MAX if none */
+static uint32_t dir_slots_find(struct dir_slots *s, uint32_t need){
+	uint32_t idx, best = UINT32_MAX;
+	int class;
+
+	if(s->blocks == 0) return UINT32_MAX;
+
+	// gaps of the class of NEED may be too small, larger classes fit
+	class = dir_slot_class(need);
+	ASSERT(class >= 0);
+	for(idx = bitmap_scan(s->classes[class],0,1,true); idx != BITMAP_ERROR && idx < s->blocks;
+		idx = bitmap_scan(s->classes[class],idx+1,1,true))
+		if(s->gap[idx] >= need){
+			best = idx;
+			break;
+		}
+	for(class++; class < DIR_SLOT_CLASSES; class++){
+		idx = bitmap_scan(s->classes[class],0,1,true);
+		if(idx != BITMAP_ERROR && idx < best) best = idx;
+	}
+	return best < s->blocks ? best : UINT32_MAX;
+}
+/* Size class of a gap of GAP bytes, -1 if no entry fits in it */
+static int dir_slot_class(uint32_t gap){
+	int class = 0;
+
+	if(gap < DIR_ENTRY_LEN(1)) return -1;
+	for(gap >>= 4; gap > 0 && class < DIR_SLOT_CLASSES - 1; gap >>= 1) class++;
+	return class;
+}
+
+/* Find entry NAME of LEN bytes in directory block DATA */
+struct directory *dir_find_in_block(void *data, uint32_t block_size, const char *name, size_t len){
+	struct directory *cur;
+	uint32_t pos;
+
+	for(pos = 0; pos + DIR_HEADER <= block_size; pos += cur->rec_len){
+		cur = (struct directory*)((uint8_t*)data + pos);
+		if(cur->rec_len < DIR_HEADER || pos + cur->rec_len > block_size) break;
+		if(cur->inode != 0 && cur->name_len == len && memcmp(cur->name,name,len) == 0)
+			return cur;
+	}
+	return NULL;
+}
+/* Add entry NAME for inode INO of TYPE to directory block DATA, in the
+ * slack of an existing entry. Returns false if no slack is large enough.
+*/
+bool dir_insert_in_block(void *data, uint32_t block_size, const char *name, size_t len, uint32_t ino, uint8_t type){
+	struct directory *cur, *next;
+	uint32_t pos, used, need = DIR_ENTRY_LEN(len);
+
+	for(pos = 0; pos + DIR_HEADER <= block_size; pos += cur->rec_len){
+		cur = (struct directory*)((uint8_t*)data + pos);
+		if(cur->rec_len < DIR_HEADER || pos + cur->rec_len > block_size) break;
+		used = cur->inode != 0 ? DIR_ENTRY_LEN(cur->name_len) : 0;
+		if(cur->rec_len < used + need) continue;
+
+		// split the slack off a used entry
+		if(used > 0){
+			next = (struct directory*)((uint8_t*)cur + used);
+			next->rec_len = cur->rec_len - used;
+			cur->rec_len = used;
+			cur = next;
+		}
+		cur->inode = ino;
+		cur->name_len = len;
+		cur->file_type = type;
+		memcpy(cur->name,name,len);
+		return true;
+	}
+	return false;
+}
+/* Remove entry NAME from directory block DATA and store its inode in INO.
+ * Its space goes to the entry before it, the first entry of a block is
+ * only marked unused. Returns false if there is no such entry.
+*/
+bool dir_remove_in_block(void *data, uint32_t block_size, const char *name, size_t len, uint32_t *ino){
+	struct directory *cur, *prev = NULL;
+	uint32_t pos;
+
+	for(pos = 0; pos + DIR_HEADER <= block_size; pos += cur->rec_len){
+		cur = (struct directory*)((uint8_t*)data + pos);
+		if(cur->rec_len < DIR_HEADER || pos + cur->rec_len > block_size) break;
+		if(cur->inode != 0 && cur->name_len == len && memcmp(cur->name,name,len) == 0){
+			if(ino != NULL) *ino = cur->inode;
+			if(prev != NULL) prev->rec_len += cur->rec_len;
+			else cur->inode = 0;
+			return true;
+		}
+		prev = cur;
+	}
+	return false;
+}
 
-	return root;
+/* Fill ENTRY for inode INO of TYPE called NAME */
+static void dir_set_entry(struct directory *entry, uint32_t ino, uint8_t type, const char *name, size_t len){
+	memset(entry,0,sizeof(struct directory));
+	entry->inode = ino;
+	entry->file_type = type;
+	entry->name_len = len;
+	memcpy(entry->name,name,len);
+	entry->rec_len = DIR_ENTRY_LEN(len);
 }
 
 struct directory *dir_get_next(struct directory *dir){
@@ -1,8 +1,10 @@
 #ifndef EXT2_DIRECTORY_H
-#define EXT2_DIRECTORY_
+#define EXT2_DIRECTORY_H
 
 #include "filesys/ext2/inode.h"
+#include "filesys/ext2/cache.h"
 #include <stddef.h>
+#include <stdbool.h>
 
 struct directory {
 	uint32_t inode;
@@ -22,7 +24,43 @@ struct directory {
 #define EXT2_FT_SOCK		6	//Socket File
 #define EXT2_FT_SYMLINK		7	//Symbolic Link
 
+// bytes used by an entry with a name of LEN bytes, rec_len may be larger
+#define DIR_ENTRY_LEN(len) (((len) + 8 + 3) & ~3u)
+
+// dir_find() and friends read the directory, the name is not in it
+#define DIR_NOT_FOUND 1
+
+/* Block by block scan of a directory through the buffer cache,
+ * the caller holds the directory inode lock, shared if it only reads.
+ * See dir_iter_next().
+*/
+struct dir_iter {
+	struct block *device;
+	struct inode *dir;
+	uint32_t block_size;
+	uint32_t blocks;			// directory size in blocks
+	uint32_t logical;			// block being visited
+	uint32_t next;				// block visited next
+	struct inode_extent extent;	// mapping of the blocks around next
+	struct cache_block *b;		// block being visited, NULL if none
+};
+
+void dir_init(void);
+void dir_free(void);
+
+void dir_iter_init(struct dir_iter *it, struct block *d, struct inode *dir, uint32_t first);
+void *dir_iter_next(struct dir_iter *it);
+void dir_iter_mark_dirty(struct dir_iter *it);
+void dir_iter_done(struct dir_iter *it);
+
+int dir_add_entry(struct block *d, uint32_t dir_ino, struct inode *dir, const char *name, size_t len, uint32_t ino, uint8_t type);
+int dir_remove_entry(struct block *d, uint32_t dir_ino, struct inode *dir, const char *name, size_t len, uint32_t *ino);
+struct cache_block *dir_append_block(struct block *d, uint32_t dir_ino, struct inode *dir, uint32_t *logical);
+
 struct directory *dir_get_next(struct directory *dir);
+struct directory *dir_find_in_block(void *data, uint32_t block_size, const char *name, size_t len);
+bool dir_insert_in_block(void *data, uint32_t block_size, const char *name, size_t len, uint32_t ino, uint8_t type);
+bool dir_remove_in_block(void *data, uint32_t block_size, const char *name, size_t len, uint32_t *ino);
 struct directory *dir_lookup(struct block *d, const char *path);
 void print_directory(struct directory *dir);
 #endif
@@ -2,6 +2,10 @@
 #include "filesys/ext2/superblock.h"
 #include "filesys/ext2/block_group.h"
 #include "filesys/ext2/free-map.h"
+#include "filesys/ext2/inode.h"
+#include "filesys/ext2/cache.h"
+#include "filesys/ext2/dentry.h"
+#include "filesys/ext2/directory.h"
 #include "devices/block.h"
 #include "kernel/kmalloc.h"
 #include "kernel/synch.h"
@@ -25,6 +29,9 @@ static uint32_t byte_to_sector(size_t bytes);
 static struct superblock *ext2_read_superblock(struct block *d);
 static struct bg_desc_table *ext2_read_bg_desc_tables(struct block *d);
 
+// Write-back
+static void ext2_flush_meta(void);
+
 // Synchronisation Mechanisms
 static struct lock register_lock;
 
@@ -55,13 +62,12 @@ uint32_t ext2_get_block_size(struct superblock *sb){
 }
 
 /* Reads a block from block device,
- * the block size of a file system may be different from device sector size
+ * the block size of a file system may be different from device sector size.
+ * The block is served from the buffer cache.
 */
 void* ext2_read_block(struct block *d, uint32_t block_idx, uint32_t block_size, void *buffer_){
 	void *buffer = buffer_;
-	int sectors = byte_to_sector(block_size);
-	int sector_idx = block_idx * sectors;
-	int i;
+	struct cache_block *b;
 
 	ASSERT(d != NULL);
 	ASSERT((block_size % BLOCK_SECTOR_SIZE) == 0);
@@ -70,23 +76,99 @@ void* ext2_read_block(struct block *d, uint32_t block_idx, uint32_t block_size,
 	if(buffer == NULL) buffer = kmalloc(block_size);
 	ASSERT(buffer != NULL);
 
-	// read from disk
-	for(i = 0; i < sectors; i++){
-		block_read(d,sector_idx+i,(void*)((uint8_t*)buffer+i*BLOCK_SECTOR_SIZE));
-	}
+	// read through cache
+	b = cache_get(d,block_idx,true);
+	memcpy(buffer,cache_data(b),block_size);
+	cache_put(b);
+
 	return buffer;
 }
 void ext2_write_block(struct block *d, uint32_t block_idx, uint32_t block_size, const void *buffer){
-	int sectors = byte_to_sector(block_size);
-	int sector_idx = block_idx * sectors;
-	int i;
+	struct cache_block *b;
 
 	ASSERT(d != NULL);
 	ASSERT((block_size % BLOCK_SECTOR_SIZE) == 0);
 	
-	// write to disk
-	for(i = 0; i < sectors; i++){
-		block_write(d,sector_idx+i,(void*)((uint8_t*)buffer+i*BLOCK_SECTOR_SIZE));
+	// write through cache, the whole block is overwritten
+	b = cache_get(d,block_idx,false);
+	memcpy(cache_data(b),buffer,block_size);
+	cache_mark_dirty(b);
+	cache_put(b);
+}
+
+/* Reads COUNT consecutive blocks starting at BLOCK_IDX into BUFFER.
+ * Cached blocks are copied from the cache, each run of uncached blocks
+ * is read from the device in a single request without being cached.
+*/
+void ext2_read_blocks(struct block *d, uint32_t block_idx, uint32_t count, uint32_t block_size, void *buffer){
+	struct block_iovec iov;
+	struct cache_block *b;
+	uint8_t *dst = buffer;
+	uint32_t i, run = 0;
+
+	ASSERT(d != NULL && buffer != NULL);
+	ASSERT((block_size % BLOCK_SECTOR_SIZE) == 0);
+
+	for(i = 0; i <= count; i++){
+		b = i < count ? cache_find(d,block_idx+i) : NULL;
+		// Extend uncached run
+		if(i < count && b == NULL){
+			run++;
+			continue;
+		}
+		// Read uncached run in one request
+		if(run > 0){
+			iov.base = dst + (i-run)*block_size;
+			iov.len = run*block_size;
+			block_readv(d,(block_idx+i-run)*byte_to_sector(block_size),&iov,1);
+			run = 0;
+		}
+		if(b != NULL){
+			memcpy(dst+i*block_size,cache_data(b),block_size);
+			cache_put(b);
+		}
+	}
+}
+/* Writes COUNT consecutive blocks starting at BLOCK_IDX from BUFFER.
+ * Cached blocks are updated in the cache, each run of uncached blocks
+ * is written to the device in a single request.
+*/
+void ext2_write_blocks(struct block *d, uint32_t block_idx, uint32_t count, uint32_t block_size, const void *buffer){
+	struct block_iovec iov;
+	struct cache_block *b;
+	const uint8_t *src = buffer;
+	uint32_t i, j, run = 0;
+
+	ASSERT(d != NULL && buffer != NULL);
+	ASSERT((block_size % BLOCK_SECTOR_SIZE) == 0);
+
+	for(i = 0; i <= count; i++){
+		b = i < count ? cache_find(d,block_idx+i) : NULL;
+		// Extend uncached run
+		if(i < count && b == NULL){
+			run++;
+			continue;
+		}
+		// Write uncached run in one request
+		if(run > 0){
+			iov.base = (void*)(src + (i-run)*block_size);
+			iov.len = run*block_size;
+			block_writev(d,(block_idx+i-run)*byte_to_sector(block_size),&iov,1);
+			// Refresh blocks cached by someone else meanwhile, cache_find()
+			// waits for fills that may have read the old content
+			for(j = i-run; j < i; j++){
+				struct cache_block *c = cache_find(d,block_idx+j);
+				if(c == NULL) continue;
+				memcpy(cache_data(c),src+j*block_size,block_size);
+				cache_put(c);
+			}
+			run = 0;
+		}
+		if(b != NULL){
+			memcpy(cache_data(b),src+i*block_size,block_size);
+			cache_mark_dirty(b);
+			cache_put(b);
+		}
 	}
 }
 
@@ -111,18 +193,32 @@ int ext2_init(){
 	lock_init(&register_lock);
 	// Initialise free map
 	freemap_init();
+	// Initialise inode cache
+	inode_cache_init();
+	// Initialise directory entry cache
+	dentry_init();
+	// Initialise directory free slot indexes
+	dir_init();
 	return 0;
 }
 
 void ext2_free(){
 	struct ext2_meta_data *ptr = NULL;
 	int i;
+	// Write back and release inodes and free map before meta data is gone
+	cache_set_flush_hook(NULL);
+	dentry_free();
+	dir_free();
+	inode_cache_free();
+	freemap_done();
 	for(i = 0; i < ext2_devices_count; i++){
 		ptr = ext2_meta[i];
 		if(ptr == NULL) continue;
 		if(ptr->sb != NULL) kfree(ptr->sb);
 		if(ptr->bg_desc_tabs != NULL) kfree(ptr->bg_desc_tabs);
 	}
+	// Release buffer cache
+	cache_free();
 }
 
 /* Registers block device */
@@ -148,8 +244,14 @@ int ext2_register(struct block *d){
 	// The following can be done without locking
 	// Read superblock
 	meta->sb = ext2_read_superblock(d);
+	// Initialise buffer cache
+	cache_init(ext2_get_block_size(meta->sb));
 	// Read block group descriptor table
 	meta->bg_desc_tabs = ext2_read_bg_desc_tables(d);
+	// Set up block group allocation state
+	freemap_load();
+	// Copy in-memory meta data into the cache before write-back
+	cache_set_flush_hook(ext2_flush_meta);
 
 	//Print message
 	printf("Device %s is registered in ext2 filesys.\n",block_name(d));
@@ -157,6 +259,12 @@ int ext2_register(struct block *d){
 	return 0;
 }
 
+/* Flush hook of the buffer cache */
+static void ext2_flush_meta(void){
+	inode_flush_all();
+	freemap_flush();
+}
+
 static struct superblock *ext2_read_superblock(struct block *d){
 	int i;
 	uint32_t sectors = byte_to_sector(EXT2_SUPER_SIZE);
@@ -175,15 +283,22 @@ static struct superblock *ext2_read_superblock(struct block *d){
 
 	return sb;
 }
+/* Writes the superblock into the fs block holding it */
 void ext2_write_superblock(struct block *d, void *sb){
-	int i;
-	uint32_t sectors = byte_to_sector(EXT2_SUPER_SIZE);
-	uint32_t sector_idx = EXT2_SUPER_OFFSET/BLOCK_SECTOR_SIZE;
+	struct ext2_meta_data *meta = NULL;
+	struct cache_block *b;
+	uint32_t block_size = 0;
 
 	ASSERT(d != NULL && sb != NULL);
+	meta = ext2_get_meta(d);
+	ASSERT(meta != NULL && meta->sb != NULL);
+	block_size = ext2_get_block_size(meta->sb);
 
-	for(i = 0 ; i < sectors; i++)
-		block_write(d,sector_idx+i,(void*)((uint8_t*)sb+i*BLOCK_SECTOR_SIZE));
+	// superblock shares block 0 with the boot record if block size > 1024
+	b = cache_get(d,EXT2_SUPER_OFFSET/block_size,true);
+	memcpy((uint8_t*)cache_data(b)+EXT2_SUPER_OFFSET%block_size,sb,EXT2_SUPER_SIZE);
+	cache_mark_dirty(b);
+	cache_put(b);
 }
 
 
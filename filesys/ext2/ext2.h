@@ -31,9 +31,11 @@ void ext2_free();
 struct ext2_meta_data *ext2_get_meta(struct block *d);
 uint32_t ext2_get_block_size(struct superblock *sb);
 void* ext2_read_block(struct block *d, uint32_t block_idx, uint32_t block_size, void *buffer_);
+void ext2_read_blocks(struct block *d, uint32_t block_idx, uint32_t count, uint32_t block_size, void *buffer);
 struct bitmap* ext2_read_bitmap(struct block *d, int block_idx);
 
 void ext2_write_block(struct block *d, uint32_t block_idx, uint32_t block_size, const void *buffer);
+void ext2_write_blocks(struct block *d, uint32_t block_idx, uint32_t count, uint32_t block_size, const void *buffer);
 void ext2_write_superblock(struct block *d, void *sb);
 void ext2_write_bg_desc_tables(struct block *d, void *bg_desc_tabs);
 
@@ -1,13 +1,18 @@
 #include "filesys/file.h"
 #include "filesys/ext2/inode.h"
+#include "filesys/ext2/cache.h"
 
 #include "kernel/kmalloc.h"
 #include "devices/block.h"
 #include "kernel/synch.h"
 
 #include <stddef.h>
+#include <string.h>
 #include <debug.h>
 
+static off_t file_iov_size(const struct block_iovec *iov, size_t iov_cnt);
+static void file_demote(struct file *file, off_t offset, off_t len);
+
 /* Opening and closing files. */
 struct file *file_open (struct block *device,struct directory *dir,struct inode *inode){
 	struct file * file = NULL;
@@ -21,20 +26,37 @@ struct file *file_open (struct block *device,struct directory *dir,struct inode
 		file->inode = inode;
 		file->pos = 0;
 		file->deny_write = false;
+		file->direct = false;
+		file->noreuse = false;
+		inode_readahead_init(&file->ra);
 		lock_init(&file->lock);
 	}
 	
 	return file;
 }
 struct file *file_reopen (struct file *file){
-	return file_open(file->device,file->dir,file->inode);
+	struct directory *dir;
+	struct file *reopened;
+
+	// Each handle owns its directory entry and a reference to the inode
+	dir = kmalloc(sizeof(struct directory));
+	if(dir == NULL) return NULL;
+	memcpy(dir,file->dir,sizeof(struct directory));
+	reopened = file_open(file->device,dir,inode_reopen(file->inode));
+	if(reopened == NULL){
+		ext2_put_inode(file->device,file->inode);
+		kfree(dir);
+	}
+	else reopened->direct = file->direct;
+	return reopened;
 }
 void file_close (struct file *file){
 	if(file != NULL){
 		file_allow_write(file);
-		// TODO should flush any changes.
+		// Copy the inode into the inode table, file_fsync() makes it durable
+		inode_flush(file->device,file->inode);
 		kfree(file->dir);
-		kfree(file->inode);
+		ext2_put_inode(file->device,file->inode);
 		kfree(file);
 	}
 }
@@ -43,56 +65,170 @@ struct inode *file_get_inode (struct file *file){
 }
 
 /* Reading and writing. */
+/* Readers share the inode lock, only the file position serialises
+ * file_read() and file_write() calls on one handle. Positional calls
+ * leave it alone. Writes lock the inode in inode_writev_at().
+ * The single buffer calls are vectored calls with one buffer.
+*/
 off_t file_read (struct file *file, void *buffer, off_t size){
+	struct block_iovec iov = {buffer, size};
+
+	if(size <= 0) return 0;
+	return file_readv(file,&iov,1);
+}
+off_t file_read_at (struct file *file, void *buffer, off_t size, off_t start){
+	struct block_iovec iov = {buffer, size};
+
+	if(size <= 0) return 0;
+	return file_readv_at(file,&iov,1,start);
+}
+off_t file_write (struct file *file, const void *buffer, off_t size){
+	struct block_iovec iov = {(void*)buffer, size};
+
+	if(size <= 0) return 0;
+	return file_writev(file,&iov,1);
+}
+off_t file_write_at (struct file *file, const void *buffer, off_t size, off_t start){
+	struct block_iovec iov = {(void*)buffer, size};
+
+	if(size <= 0) return 0;
+	return file_writev_at(file,&iov,1,start);
+}
+/* Read into the IOV_CNT buffers of IOV in order, in one pass over the
+ * block map.
+*/
+off_t file_readv (struct file *file, const struct block_iovec *iov, size_t iov_cnt){
 	lock_acquire(&file->lock);
-	off_t bytes_read = inode_read_at(file->device,file->inode, buffer, size, file->pos);
+	inode_lock_shared(file->inode);
+	if(!file->direct) inode_readahead(file->device,file->inode,&file->ra,file->pos,file_iov_size(iov,iov_cnt));
+	off_t bytes_read = inode_readv_at(file->device,file->inode,iov,iov_cnt,file->pos,file->direct);
+	if(file->noreuse) inode_cache_range(file->device,file->inode,file->pos,bytes_read,INODE_CACHE_DEMOTE);
+	inode_unlock_shared(file->inode);
 	file->pos += bytes_read;
 	lock_release(&file->lock);
 	return bytes_read;
 }
-off_t file_read_at (struct file *file, void *buffer, off_t size, off_t start){
+off_t file_readv_at (struct file *file, const struct block_iovec *iov, size_t iov_cnt, off_t start){
 	ASSERT(start >= 0);
 
-	lock_acquire(&file->lock);
-	off_t bytes_read = inode_read_at(file->device,file->inode, buffer, size, start);
-	file->pos += bytes_read;
-	lock_release(&file->lock);
+	inode_lock_shared(file->inode);
+	if(!file->direct) inode_readahead(file->device,file->inode,&file->ra,start,file_iov_size(iov,iov_cnt));
+	off_t bytes_read = inode_readv_at(file->device,file->inode,iov,iov_cnt,start,file->direct);
+	if(file->noreuse) inode_cache_range(file->device,file->inode,start,bytes_read,INODE_CACHE_DEMOTE);
+	inode_unlock_shared(file->inode);
 	return bytes_read;
 }
-off_t file_write (struct file *file, const void *buffer, off_t size){
+/* Write the IOV_CNT buffers of IOV in order as one write, the file is
+ * resized and its inode updated once.
+*/
+off_t file_writev (struct file *file, const struct block_iovec *iov, size_t iov_cnt){
 	lock_acquire(&file->lock);
-	off_t bytes_written = inode_write_at(file->device,file->inode,buffer,size,file->pos);
+	off_t bytes_written = inode_writev_at(file->device,file->dir->inode,file->inode,iov,iov_cnt,file->pos,file->direct);
+	if(file->noreuse) file_demote(file,file->pos,bytes_written);
 	file->pos+= bytes_written;
-	// Update inode in disk
-	ext2_write_inode(file->device,file->dir->inode,file->inode);
 	lock_release(&file->lock);
 	return bytes_written;
 }
-off_t file_write_at (struct file *file, const void *buffer, off_t size, off_t start){
+off_t file_writev_at (struct file *file, const struct block_iovec *iov, size_t iov_cnt, off_t start){
 	ASSERT(start >= 0);
 
-	lock_acquire(&file->lock);
-	off_t bytes_written = inode_write_at(file->device,file->inode,buffer,size,start);
-	file->pos+= bytes_written;
-	// Update inode in disk
-	ext2_write_inode(file->device,file->dir->inode,file->inode);
-	lock_release(&file->lock);
+	off_t bytes_written = inode_writev_at(file->device,file->dir->inode,file->inode,iov,iov_cnt,start,file->direct);
+	if(file->noreuse) file_demote(file,start,bytes_written);
 	return bytes_written;
 }
 
 int file_truncate(struct file *file, off_t size){
 	int err;
 	lock_acquire(&file->lock);
-	err = inode_resize(file->inode,size);
+	inode_lock(file->inode);
+	err = inode_resize(file->dir->inode,file->inode,size);
+	// Inode is written back lazily
+	inode_mark_dirty(file->inode);
+	inode_unlock(file->inode);
 	// Update position
 	if(err == 0 && file->pos >= size)
 		file->pos = size-1;
-	// Update inode
-	ext2_write_inode(file->device,file->dir->inode,file->inode);
 	lock_release(&file->lock);
 
 	return err;
 }
+/* Allocate the blocks of [OFFSET, OFFSET+LEN) ahead of writing,
+ * extending the file if needed. Returns 0 on success.
+*/
+int file_allocate(struct file *file, off_t offset, off_t len){
+	int err;
+	lock_acquire(&file->lock);
+	inode_lock(file->inode);
+	err = inode_fallocate(file->device,file->dir->inode,file->inode,offset,len);
+	// Inode is written back lazily
+	inode_mark_dirty(file->inode);
+	inode_unlock(file->inode);
+	lock_release(&file->lock);
+
+	return err;
+}
+
+/* Access pattern hints. */
+/* Advise how LEN bytes of FILE at OFFSET are going to be accessed, up to
+ * the end of the file if LEN is 0, like posix_fadvise().
+ * SEQUENTIAL, RANDOM and NORMAL set the readahead policy of the handle,
+ * NOREUSE has the blocks it reads and writes replaced first until NORMAL.
+ * These apply to the whole file.
+ * WILLNEED reads the range into the cache in the background, DONTNEED
+ * writes the cached range back and drops it.
+ * Returns 0, or -1 if the arguments are invalid.
+*/
+int file_advise (struct file *file, off_t offset, off_t len, enum FILE_ADVICE advice){
+	off_t length;
+
+	ASSERT(file != NULL);
+	if(offset < 0 || len < 0) return -1;
+
+	length = file_length(file);
+	if(len == 0 || len > length - offset) len = length - offset;
+
+	switch(advice){
+		case FILE_ADVICE_NORMAL:
+		case FILE_ADVICE_SEQUENTIAL:
+		case FILE_ADVICE_RANDOM:
+			lock_acquire(&file->ra.lock);
+			file->ra.mode = advice == FILE_ADVICE_SEQUENTIAL ? INODE_RA_SEQUENTIAL
+				: advice == FILE_ADVICE_RANDOM ? INODE_RA_RANDOM : INODE_RA_NORMAL;
+			lock_release(&file->ra.lock);
+			if(advice == FILE_ADVICE_NORMAL) file->noreuse = false;
+			break;
+		case FILE_ADVICE_NOREUSE:
+			file->noreuse = true;
+			break;
+		case FILE_ADVICE_WILLNEED:
+			// Like readahead, never more than a quarter of the cache
+			if(len > CACHE_BUDGET / 4) len = CACHE_BUDGET / 4;
+			inode_prefetch(file->device,file->inode,offset,len);
+			break;
+		case FILE_ADVICE_DONTNEED:
+			inode_lock_shared(file->inode);
+			inode_cache_range(file->device,file->inode,offset,len,INODE_CACHE_DROP);
+			inode_unlock_shared(file->inode);
+			break;
+		default:
+			return -1;
+	}
+	return 0;
+}
+
+/* Durability. */
+/* Write the file's data, indirect blocks and inode to the device */
+void file_fsync(struct file *file){
+	ASSERT(file != NULL);
+	inode_sync(file->device,file->inode,false);
+}
+/* Like file_fsync(), the inode is only written if the file size or
+ * block map changed.
+*/
+void file_datasync(struct file *file){
+	ASSERT(file != NULL);
+	inode_sync(file->device,file->inode,true);
+}
 
 /* Preventing writes. */
 void file_deny_write (struct file *file){
@@ -119,4 +255,17 @@ off_t file_length (struct file *file){
 	return file->inode->i_size;
 }
 
+/* Total length of the IOV_CNT buffers of IOV */
+static off_t file_iov_size(const struct block_iovec *iov, size_t iov_cnt){
+	off_t size = 0;
+	size_t i;
 
+	for(i = 0; i < iov_cnt; i++) size += iov[i].len;
+	return size;
+}
+/* Have the cached blocks of LEN bytes of FILE at OFFSET replaced first */
+static void file_demote(struct file *file, off_t offset, off_t len){
+	inode_lock_shared(file->inode);
+	inode_cache_range(file->device,file->inode,offset,len,INODE_CACHE_DEMOTE);
+	inode_unlock_shared(file->inode);
+}
@@ -4,6 +4,8 @@
 #include "filesys/ext2/ext2.h"
 #include "filesys/ext2/inode.h"
 #include "filesys/ext2/free-map.h"
+#include "filesys/ext2/cache.h"
+#include "filesys/ext2/dentry.h"
 #include "kernel/kmalloc.h"
 
 #include <stdbool.h>
@@ -30,6 +32,15 @@ void filesys_init (bool format){
 }
 
 struct file *filesys_open (const char *name){
+	return filesys_open_flags(name,0);
+}
+/* Open NAME with FILESYS_O_* FLAGS.
+ * With FILESYS_O_DIRECT whole blocks move between the caller's buffers and
+ * the device, partial blocks through a bounce block, and nothing is added
+ * to the buffer cache. Blocks cached by other users are still used and
+ * kept coherent.
+*/
+struct file *filesys_open_flags (const char *name, int flags){
 	struct block *block = NULL;
 	struct directory *file_desc = NULL;
 	struct inode *file_ino = NULL;
@@ -51,18 +62,25 @@ struct file *filesys_open (const char *name){
 	// open file
 	if(file_ino != NULL)
 		file = file_open(block,file_desc,file_ino);
+	if(file != NULL)
+		file->direct = (flags & FILESYS_O_DIRECT) != 0;
 
 	return file;
 }
 
 void filesys_done (void){
-	// TODO 
 	// Flush any caches
+	cache_flush(NULL);
 
 	// free memory
 	ext2_free();
 }
 
+/* Write every cached change of the volume to the device */
+void filesys_sync (void){
+	cache_flush(fs_device);
+}
+
 bool filesys_create (const char *path, off_t initial_size, enum FILE_TYPE type, uint32_t permission){
 	struct block *d = NULL;
 	struct ext2_meta_data *meta = NULL;
@@ -70,11 +88,10 @@ bool filesys_create (const char *path, off_t initial_size, enum FILE_TYPE type,
 	struct directory *parent_dir = NULL;
 	struct file *parent_file = NULL;
 	struct directory *directory_data = NULL;
-	struct directory *last_entry = NULL;
-	uint32_t file_size = 0, bytes_read = 0;
-	uint32_t inode_num;
+	uint32_t inode_num, name_len;
 	struct inode inode;
-	int err, i;
+	uint8_t file_type;
+	int err;
 	bool success = false;
 
 	ASSERT(path != NULL && initial_size >= 0);
@@ -112,72 +129,46 @@ bool filesys_create (const char *path, off_t initial_size, enum FILE_TYPE type,
 	parent_file = filesys_open(parent);
 	if(parent_file == NULL) goto cleanup;
 
-	// Get parent directory data
-	file_size = parent_file->inode->i_size;
-	directory_data = kmalloc(file_size);
-	bytes_read = file_read(parent_file,directory_data,file_size);
-	if(bytes_read != file_size) goto cleanup;
-	
-	// Get last entry
-	last_entry = directory_data;
-	do {
-		last_entry = dir_get_next(last_entry);
-	} while (last_entry != NULL 
-		&& last_entry->inode != 0 
-		&& (uint8_t*)last_entry+last_entry->rec_len < (uint8_t*)directory_data+file_size);
-
-	// check if pointer passed file limit
-	if(last_entry == NULL || (uint8_t*)last_entry >= (uint8_t*)directory_data+file_size)
-		goto cleanup;
+	name_len = strlen(name);
+	if(name_len > UINT8_MAX) name_len = UINT8_MAX;
+	switch(type){
+		case FILESYS_REGULAR: 
+			file_type = EXT2_FT_REG_FILE;
+			break;
+		case FILESYS_DIRECTORY: 
+			file_type = EXT2_FT_DIR;
+			break;
+		default:
+			file_type = EXT2_FT_UNKNOWN;
+			break;
+	};
 
 	// Get free inode
 	inode_num = freemap_get_inode();
 	if(inode_num == FREEMAP_GET_ERROR) goto cleanup;
-
-	// Recalibrate record length
-	if(last_entry->inode != 0){
-		last_entry->rec_len = sizeof(struct directory) - (UINT8_MAX - last_entry->name_len);
-		// Align 4 bytes
-		i = last_entry->rec_len % 4;
-		if(i > 0) last_entry->rec_len += (4-i);
-	}
-
-	// Goto new last entry
-	last_entry = dir_get_next(last_entry);
-	if(last_entry == NULL || (uint8_t*)last_entry >= (uint8_t*)directory_data+file_size)
-		goto cleanup;
 	
 	// Create inode
 	memset(&inode,0,sizeof(struct inode));
 	inode.i_mode = EXT2_S_IFREG | permission;
 	inode.i_links_count = 1;
-	err = inode_resize(&inode,initial_size);
+	err = inode_resize(inode_num,&inode,initial_size);
 	if(err < 0) goto cleanup;
 	// Write inode to disk
 	ext2_write_inode(d,inode_num,&inode);
-	
-	// Create file entry
-	memset(last_entry,0,sizeof(struct directory));
-	last_entry->inode = inode_num;
-	last_entry->name_len = strlen(name);
-	if(last_entry->name_len > UINT8_MAX) last_entry->name_len = UINT8_MAX;
-	memcpy(last_entry->name,name, last_entry->name_len);
-	switch(type){
-		case FILESYS_REGULAR: 
-			last_entry -> file_type = EXT2_FT_REG_FILE;
-			break;
-		case FILESYS_DIRECTORY: 
-			last_entry -> file_type = EXT2_FT_DIR;
-			break;
-		default:
-			last_entry -> file_type = EXT2_FT_UNKNOWN;
-			break;
-	};
-	last_entry->rec_len = ext2_get_block_size(meta->sb) - 
-		(uint32_t)((uintptr_t)last_entry - (uintptr_t) directory_data);
 
-	// Write directory file
-	file_write_at(parent_file,directory_data,file_size,0);
+	// Add file entry, only the directory block receiving it is written
+	if(dir_add_entry(d,parent_dir->inode,parent_file->inode,name,name_len,inode_num,file_type) < 0){
+		inode_resize(inode_num,&inode,0);
+		// Clear the entry written above before its number is reused
+		memset(&inode,0,sizeof(struct inode));
+		ext2_write_inode(d,inode_num,&inode);
+		freemap_free_inode(inode_num);
+		goto cleanup;
+	}
+
+	// Cache the new entry
+	dentry_invalidate(d,parent_dir->inode,name,name_len);
+	dentry_insert(d,parent_dir->inode,name,name_len,inode_num,file_type,dentry_generation());
 	
 	// file created successfully.
 	success = true;
@@ -200,9 +191,7 @@ bool filesys_remove (const char *path){
 	char *parent = NULL, *name = NULL;
 	struct directory *parent_dir = NULL;
 	struct file *parent_file = NULL, *file = NULL;
-	struct directory *directory_data = NULL;
-	struct directory *file_entry = NULL, *last_entry = NULL;
-	uint32_t file_size = 0, bytes_read = 0;
+	uint32_t file_ino;
 	bool success = false;
 
 	ASSERT(path != NULL && strlen(path) > 0);
@@ -246,44 +235,15 @@ bool filesys_remove (const char *path){
 	parent_file = filesys_open(parent);
 	if(parent_file == NULL) goto cleanup;
 
-	// Get parent directory data
-	file_size = parent_file->inode->i_size;
-	directory_data = kmalloc(file_size);
-	bytes_read = file_read(parent_file,directory_data,file_size);
-	if(bytes_read != file_size) goto cleanup;
-	
-	// Get file directory entry
-	file_entry = directory_data;
-	while (file_entry != NULL 
-		&& memcmp(file_entry->name,name,file_entry->name_len) != 0
-		&& (uint8_t*)file_entry+file_entry->rec_len < (uint8_t*)directory_data+file_size){
-		last_entry = file_entry;
-		file_entry = dir_get_next(file_entry);
-	}
-
-	// check if file entry if found.
-	if( (uint8_t*)file_entry >= (uint8_t*)directory_data+file_size
-		|| memcmp(file_entry->name,name,file_entry->name_len) != 0 )
+	// Drop file entry, only the directory block holding it is written
+	if(dir_remove_entry(d,parent_dir->inode,parent_file->inode,name,strlen(name),&file_ino) != 0)
 		goto cleanup;
 
-	// Truncate file to zero length
-	// Aka. Free blocks
-	file_truncate(file,0);
+	// Blocks and inode are freed once the last handle is closed
+	inode_unlink(file->inode);
 
-	// Zero inode
-	memset(file->inode,0,sizeof(struct inode));
-	ext2_write_inode(d,file->dir->inode,file->inode);
-
-	// Free inode
-	freemap_free_inode(file_entry->inode);
-	
-	// Delete directory record
-	// Use last entry record length to skip file entry
-	if(last_entry->inode != 0)
-		last_entry->rec_len += file_entry->rec_len;
-
-	// Write directory file
-	file_write_at(parent_file,directory_data,file_size,0);
+	// Forget the cached entry
+	dentry_invalidate(d,parent_dir->inode,name,strlen(name));
 	
 	// file deleted successfully.
 	success = true;
@@ -296,7 +256,6 @@ cleanup:
 	if(parent != NULL) kfree(parent);
 	if(name != NULL) kfree(name);
 	if(parent_dir != NULL) kfree(parent_dir);
-	if(directory_data != NULL) kfree(directory_data);
 	
 	return success;
 }
@@ -2,15 +2,18 @@
 #include "filesys/ext2/ext2.h"
 #include "filesys/ext2/superblock.h"
 #include "filesys/ext2/block_group.h"
+#include "filesys/ext2/cache.h"
 #include "devices/block.h"
 #include "kernel/synch.h"
 #include "kernel/kmalloc.h"
 
 #include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <bitmap.h>
 #include <debug.h>
+#include <round.h>
 
 /*
  * CHANGLOG
@@ -19,93 +22,175 @@
  * instead of the bitmap structure itself!
 */
 
-static struct lock freemap_lock;
+
+/*
+ * Block and inode bitmaps are read once per block group and kept in memory
+ * for the lifetime of the mount. Allocation only flips bits and marks the
+ * bitmap dirty, freemap_flush() writes dirty bitmaps, the superblock and
+ * the block group descriptor tables back through the buffer cache.
+ *
+ * Each block group has its own lock protecting its bitmaps and descriptor
+ * counters, so threads allocating in different groups do not contend.
+ * The file system wide free counts are kept in atomic counters: space is
+ * reserved there first, then taken from a group. Superblock counters are
+ * only updated from them at flush time.
+*/
+struct freemap_group {
+	struct lock lock;			// protects the fields below and the descriptor
+	struct bitmap *block_map;	// NULL until first used
+	struct bitmap *inode_map;	// NULL until first used
+	bool block_dirty;
+	bool inode_dirty;
+};
+
+static struct freemap_group *freemap_groups;
+static uint32_t freemap_group_cnt;
+static bool freemap_meta_dirty; // superblock and descriptors modified, atomic
+static uint32_t freemap_free_blocks_cnt; // atomic
+static uint32_t freemap_free_inodes_cnt; // atomic
+
+// Serialises freemap_flush()
+static struct lock freemap_flush_lock;
+
+#define FREEMAP_GOAL_COLOURS 16 // start offsets of new files in a group
+#define FREEMAP_FREE_RUN 64 // room left around new runs when the goal is taken
+
+static uint32_t freemap_reserve(uint32_t *counter, uint32_t min, uint32_t max);
+static int freemap_compare_extent(const void *a, const void *b);
+static void freemap_unreserve(uint32_t *counter, uint32_t n);
+static uint32_t freemap_get_range(uint32_t goal, uint32_t min, uint32_t *blocks, bool zero);
+static uint32_t freemap_alloc_blocks(struct block *d, struct ext2_meta_data *meta, uint32_t bg_group, uint32_t min, uint32_t *blocks, uint32_t start, bool goal);
+static uint32_t freemap_alloc_inode(struct block *d, struct ext2_meta_data *meta, uint32_t bg_group);
+static struct bitmap *freemap_block_map(struct block *d, struct ext2_meta_data *meta, uint32_t bg_group);
+static struct bitmap *freemap_inode_map(struct block *d, struct ext2_meta_data *meta, uint32_t bg_group);
 
 /* Initialise freemap */
 void freemap_init(){
-	lock_init(&freemap_lock);
+	lock_init(&freemap_flush_lock);
+	freemap_groups = NULL;
+	freemap_group_cnt = 0;
+	freemap_meta_dirty = false;
 }
-/* Get one available block from disk */
-uint32_t freemap_get_block(bool zero){
-	return freemap_get_blocks(1,zero);
-}
-/* Get BLOCKS free blocks */
-uint32_t freemap_get_blocks(uint32_t blocks,bool zero){
-	int i;
+/* Set up block group state of the mounted file system */
+void freemap_load(){
 	struct block *d = block_get_role(BLOCK_FILESYS);
 	struct ext2_meta_data *meta = NULL;
-	struct bg_desc_table *bg_desc = NULL;
-	struct bitmap *block_map = NULL;
-	uint32_t block_size = 0,free_blocks = 0, bg_groups = 0, bg_group = 0;
-	uint32_t block_id;
+	uint32_t i;
 
-	ASSERT(blocks > 0);
-	ASSERT(d != NULL);
+	ASSERT(d != NULL && freemap_groups == NULL);
 
 	meta = ext2_get_meta(d);
 	ASSERT(meta != NULL && meta->sb != NULL && meta->bg_desc_tabs != NULL);
-	block_size = ext2_get_block_size(meta->sb);
-
-	// Check if there are enough free blocks
-	free_blocks = meta->sb->s_free_blocks_count;
-	if(free_blocks < blocks) return FREEMAP_GET_ERROR;
 
-	// Get block groups
-	bg_groups = meta->sb->s_blocks_count / meta->sb->s_blocks_per_group;
+	freemap_group_cnt = DIV_ROUND_UP(meta->sb->s_blocks_count,meta->sb->s_blocks_per_group);
+	freemap_groups = kmalloc(freemap_group_cnt * sizeof(struct freemap_group));
+	ASSERT(freemap_groups != NULL);
+	memset(freemap_groups,0,freemap_group_cnt * sizeof(struct freemap_group));
+	for(i = 0; i < freemap_group_cnt; i++) lock_init(&freemap_groups[i].lock);
 
-	// Search block groups, start from the second group
-	for(i = 1; i < bg_groups; i++){
-		bg_desc = &(meta->bg_desc_tabs[i]);
-		free_blocks = bg_desc->bg_free_blocks_count;
-		if(free_blocks >= blocks) break;
-	} 
+	freemap_free_blocks_cnt = meta->sb->s_free_blocks_count;
+	freemap_free_inodes_cnt = meta->sb->s_free_inodes_count;
+}
+/* Write dirty bitmaps, superblock and descriptor tables */
+void freemap_flush(){
+	struct block *d = block_get_role(BLOCK_FILESYS);
+	struct ext2_meta_data *meta = NULL;
+	struct freemap_group *group;
+	uint32_t block_size, i;
 
-	// Check if block group is found
-	if(i == bg_groups) return FREEMAP_GET_ERROR;
-	bg_group = i; // Save block_group
+	if(freemap_groups == NULL) return;
 
-	// Acquire lock
-	lock_acquire(&freemap_lock);
+	meta = ext2_get_meta(d);
+	ASSERT(meta != NULL && meta->sb != NULL && meta->bg_desc_tabs != NULL);
+	block_size = ext2_get_block_size(meta->sb);
 
-	// Block group is found
-	block_map = ext2_read_bitmap(d,bg_desc->bg_block_bitmap);
-	block_id = bitmap_scan_and_flip (block_map,0,blocks,false);
-	if(block_id != BITMAP_ERROR){
-		// Important: offset by the block group.
-		block_id += bg_group * meta->sb->s_blocks_per_group;
-		/* Important: bit 0 of byte 0 represent the first block of the block group.
-		 * superblock is the first block of block group 0,
-		 * but it is actually located at s_first_data_block.
-		 * Hence, one must offset s_first_data_block in block id calculation.
-		*/
-		block_id += meta->sb->s_first_data_block;
-		// Update statistics
-		meta->sb->s_free_blocks_count -= blocks;
-		bg_desc->bg_free_blocks_count -= blocks;
-		// Write bitmap to disk
-		ext2_write_block(d,bg_desc->bg_block_bitmap,block_size,bitmap_get_bits(block_map));
+	lock_acquire(&freemap_flush_lock);
+	for(i = 0; i < freemap_group_cnt; i++){
+		group = &freemap_groups[i];
+		if(!group->block_dirty && !group->inode_dirty) continue;
+		lock_acquire(&group->lock);
+		if(group->block_dirty){
+			ext2_write_block(d,meta->bg_desc_tabs[i].bg_block_bitmap,block_size,bitmap_get_bits(group->block_map));
+			group->block_dirty = false;
+		}
+		if(group->inode_dirty){
+			ext2_write_block(d,meta->bg_desc_tabs[i].bg_inode_bitmap,block_size,bitmap_get_bits(group->inode_map));
+			group->inode_dirty = false;
+		}
+		lock_release(&group->lock);
+	}
+	// Clear before writing, changes made meanwhile are written next time
+	if(__atomic_exchange_n(&freemap_meta_dirty,false,__ATOMIC_ACQ_REL)){
+		meta->sb->s_free_blocks_count = __atomic_load_n(&freemap_free_blocks_cnt,__ATOMIC_RELAXED);
+		meta->sb->s_free_inodes_count = __atomic_load_n(&freemap_free_inodes_cnt,__ATOMIC_RELAXED);
 		// Write superblock
 		ext2_write_superblock(d,meta->sb);
 		// Write block group description table
-		ext2_write_bg_desc_tables(d,meta->bg_desc_tabs);	
-		// Zero newly allotted blocks
-		if(zero){
-			void *zero_buf = kmalloc(block_size);
-			memset(zero_buf,0,block_size);
-			for(i = 0; i < blocks; i++)
-				ext2_write_block(d,block_id+i,block_size,zero_buf);
-			kfree(zero_buf);
-		}
+		ext2_write_bg_desc_tables(d,meta->bg_desc_tabs);
 	}
-	lock_release(&freemap_lock);
+	lock_release(&freemap_flush_lock);
+}
+/* Flush and release bitmaps */
+void freemap_done(){
+	uint32_t i;
 
-	// Check if successful
-	if(block_id == BITMAP_ERROR) block_id = FREEMAP_GET_ERROR;
+	freemap_flush();
+
+	for(i = 0; i < freemap_group_cnt && freemap_groups != NULL; i++){
+		//free memory, this will also free internal memory
+		if(freemap_groups[i].block_map != NULL) bitmap_destroy(freemap_groups[i].block_map);
+		if(freemap_groups[i].inode_map != NULL) bitmap_destroy(freemap_groups[i].inode_map);
+	}
+	if(freemap_groups != NULL) kfree(freemap_groups);
+	freemap_groups = NULL;
+	freemap_group_cnt = 0;
+}
+/* Get one available block from disk */
+uint32_t freemap_get_block(bool zero){
+	return freemap_get_blocks_goal(0,1,zero);
+}
+/* Get BLOCKS free blocks */
+uint32_t freemap_get_blocks(uint32_t blocks,bool zero){
+	return freemap_get_blocks_goal(0,blocks,zero);
+}
+/* Get BLOCKS free blocks, as close to block GOAL as possible.
+ * The group of GOAL is searched from GOAL onwards, then the groups
+ * around it in increasing distance. GOAL 0 means no preference.
+*/
+uint32_t freemap_get_blocks_goal(uint32_t goal,uint32_t blocks,bool zero){
+	uint32_t cnt = blocks;
 
-	//free memory, this will also free internal memory
-	bitmap_destroy(block_map);
+	ASSERT(blocks > 0);
+	return freemap_get_range(goal,blocks,&cnt,zero);
+}
+/* Get a run of at least one and at most *BLOCKS free blocks, as close
+ * to block GOAL as possible. *BLOCKS is set to the length of the run.
+ * Large allocations take one run per call instead of one block.
+*/
+uint32_t freemap_get_run(uint32_t goal,uint32_t *blocks,bool zero){
+	ASSERT(blocks != NULL && *blocks > 0);
+	return freemap_get_range(goal,1,blocks,zero);
+}
+/* Get an allocation goal for the data of inode INO: a block in the block
+ * group holding the inode. Inodes start at one of FREEMAP_GOAL_COLOURS
+ * offsets in the group, so files growing at the same time do not
+ * interleave their blocks.
+*/
+uint32_t freemap_inode_goal(uint32_t ino){
+	struct block *d = block_get_role(BLOCK_FILESYS);
+	struct ext2_meta_data *meta = NULL;
+	uint32_t bg_group, colour;
 
-	return block_id;
+	meta = ext2_get_meta(d);
+	ASSERT(meta != NULL && meta->sb != NULL);
+	if(ino == 0) return 0;
+
+	bg_group = (ino - 1) / meta->sb->s_inodes_per_group;
+	colour = (ino - 1) % FREEMAP_GOAL_COLOURS;
+
+	return bg_group * meta->sb->s_blocks_per_group
+		+ colour * (meta->sb->s_blocks_per_group / FREEMAP_GOAL_COLOURS)
+		+ meta->sb->s_first_data_block;
 }
 /* Free block pointed by block id */
 void freemap_free_block(uint32_t block_id){
@@ -113,53 +198,85 @@ void freemap_free_block(uint32_t block_id){
 }
 /* Free multiple blocks starting at block id */
 void freemap_free_blocks(uint32_t block_id,uint32_t blocks){
+	struct freemap_extent extent = {block_id, blocks};
+
+	freemap_free_extents(&extent,1);
+}
+/* Free CNT runs of blocks. EXTENTS is sorted and merged in place,
+ * each block group is then locked and updated once.
+*/
+void freemap_free_extents(struct freemap_extent *extents,size_t cnt){
 	struct block *d = block_get_role(BLOCK_FILESYS);
 	struct ext2_meta_data *meta = NULL;
-	struct bg_desc_table *bg_desc = NULL;
+	struct freemap_group *group = NULL;
 	struct bitmap *block_map = NULL;
-	uint32_t block_size = 0, bg_group = 0;
-	uint32_t local_idx;
+	uint32_t bg_group, local_idx, block_id, blocks, n, total = 0;
+	size_t i, j;
 
-	ASSERT(block_id > 0 && blocks > 0);
+	ASSERT(extents != NULL);
+	ASSERT(freemap_groups != NULL);
+	if(cnt == 0) return;
 
 	meta = ext2_get_meta(d);
 	ASSERT(meta != NULL && meta->sb != NULL && meta->bg_desc_tabs != NULL);
-	block_size = ext2_get_block_size(meta->sb);
-
-	// Re-calibrate block id to data block id
-	// For details, see freemap_get_blocks().
-	block_id -= meta->sb->s_first_data_block;
-
-	// Get block group
-	bg_group = block_id / meta->sb->s_blocks_per_group;
-	bg_desc = &(meta->bg_desc_tabs[bg_group]);
 
-	// Get local block index
-	local_idx = block_id % meta->sb->s_blocks_per_group;
-
-	// Acqiure lock
-	lock_acquire(&freemap_lock);
-	// read bitmap
-	block_map = ext2_read_bitmap(d,bg_desc->bg_block_bitmap);
-	ASSERT(bitmap_all(block_map,local_idx,blocks));
+	// Sort and merge adjacent runs
+	qsort(extents,cnt,sizeof(struct freemap_extent),freemap_compare_extent);
+	for(i = 1, j = 0; i < cnt; i++){
+		if(extents[j].start + extents[j].count == extents[i].start)
+			extents[j].count += extents[i].count;
+		else extents[++j] = extents[i];
+	}
+	cnt = j + 1;
+
+	// Freed blocks must not be written back, drop them before reuse
+	for(i = 0; i < cnt; i++)
+		cache_discard(d,extents[i].start,extents[i].count);
+
+	for(i = 0; i < cnt; ){
+		// Re-calibrate block id to data block id
+		// For details, see freemap_alloc_blocks().
+		ASSERT(extents[i].start >= meta->sb->s_first_data_block && extents[i].count > 0);
+		bg_group = (extents[i].start - meta->sb->s_first_data_block) / meta->sb->s_blocks_per_group;
+		ASSERT(bg_group < freemap_group_cnt);
+		group = &freemap_groups[bg_group];
+
+		// Acqiure lock
+		lock_acquire(&group->lock);
+		// get bitmap
+		block_map = freemap_block_map(d,meta,bg_group);
+		// Free every run, or part of a run, inside the group
+		while(i < cnt){
+			block_id = extents[i].start - meta->sb->s_first_data_block;
+			if(block_id / meta->sb->s_blocks_per_group != bg_group) break;
+			local_idx = block_id % meta->sb->s_blocks_per_group;
+			blocks = extents[i].count;
+			n = meta->sb->s_blocks_per_group - local_idx;
+			if(n > blocks) n = blocks;
+
+			ASSERT(bitmap_all(block_map,local_idx,n));
+			bitmap_set_multiple(block_map,local_idx,n,false);
+			// Update statistics
+			meta->bg_desc_tabs[bg_group].bg_free_blocks_count += n;
+			total += n;
+
+			// Run continues in the next group
+			if(n < blocks){
+				extents[i].start += n;
+				extents[i].count -= n;
+				break;
+			}
+			i++;
+		}
+		// Bitmap is written by freemap_flush()
+		group->block_dirty = true;
 
-	bitmap_set_multiple(block_map,local_idx,blocks,false);
+		// free lock
+		lock_release(&group->lock);
+	}
 
-	// Update statistics
-	meta->sb->s_free_blocks_count += blocks;
-	bg_desc->bg_free_blocks_count += blocks;
-	// Write bitmap to disk
-	ext2_write_block(d,bg_desc->bg_block_bitmap,block_size,bitmap_get_bits(block_map));
-	// Write superblock
-	ext2_write_superblock(d,meta->sb);
-	// Write block group description table
-	ext2_write_bg_desc_tables(d,meta->bg_desc_tabs);	
-
-	// free lock
-	lock_release(&freemap_lock);
-
-	//free memory, this will also free internal memory
-	bitmap_destroy(block_map);
+	freemap_unreserve(&freemap_free_blocks_cnt,total);
+	__atomic_store_n(&freemap_meta_dirty,true,__ATOMIC_RELEASE);
 }
 
 /* Get free inode */
@@ -167,63 +284,32 @@ uint32_t freemap_get_inode(){
 	int i;
 	struct block *d = block_get_role(BLOCK_FILESYS);
 	struct ext2_meta_data *meta = NULL;
-	struct bg_desc_table *bg_desc = NULL;
-	struct bitmap *inode_map = NULL;
-	uint32_t block_size = 0,free_inodes = 0, bg_groups = 0, bg_group = 0;
-	uint32_t inode_id;
+	uint32_t bg_groups = 0;
+	uint32_t inode_id = FREEMAP_GET_ERROR;
 
-	ASSERT(d != NULL);
+	ASSERT(d != NULL && freemap_groups != NULL);
 
 	meta = ext2_get_meta(d);
 	ASSERT(meta != NULL && meta->sb != NULL && meta->bg_desc_tabs != NULL);
-	block_size = ext2_get_block_size(meta->sb);
 
-	// Check if there are enough free inodes
-	free_inodes = meta->sb->s_free_inodes_count;
-	if(free_inodes < 1) return FREEMAP_GET_ERROR;
+	// Reserve an inode, fails if there are no free inodes
+	if(freemap_reserve(&freemap_free_inodes_cnt,1,1) == 0) return FREEMAP_GET_ERROR;
 
 	// Get block groups
 	bg_groups = meta->sb->s_inodes_count / meta->sb->s_inodes_per_group;
 
 	// Search block groups, start from the second group
 	for(i = 1; i < bg_groups; i++){
-		bg_desc = &(meta->bg_desc_tabs[i]);
-		free_inodes = bg_desc->bg_free_inodes_count;
-		if(free_inodes > 0) break;
-	} 
-
-	// Check if block group is found
-	if(i == bg_groups) return FREEMAP_GET_ERROR;
-	bg_group = i; // Save block_group
-
-	// Acquire lock
-	lock_acquire(&freemap_lock);
-
-	// Block group is found
-	inode_map = ext2_read_bitmap(d,bg_desc->bg_inode_bitmap);
-	inode_id = bitmap_scan_and_flip (inode_map,0,1,false);
-	if(inode_id != BITMAP_ERROR){
-		// Important: offset by the block group.
-		inode_id += bg_group * meta->sb->s_inodes_per_group;
-		// Inode Number starts from 1
-		inode_id ++;
-		// Update statistics
-		meta->sb->s_free_inodes_count --;
-		bg_desc->bg_free_inodes_count --;
-		// Write bitmap to disk
-		ext2_write_block(d,bg_desc->bg_inode_bitmap,block_size,bitmap_get_bits(inode_map));
-		// Write superblock
-		ext2_write_superblock(d,meta->sb);
-		// Write block group description table
-		ext2_write_bg_desc_tables(d,meta->bg_desc_tabs);	
+		inode_id = freemap_alloc_inode(d,meta,i);
+		if(inode_id != FREEMAP_GET_ERROR) break;
 	}
-	lock_release(&freemap_lock);
 
 	// Check if successful
-	if(inode_id == BITMAP_ERROR) inode_id = FREEMAP_GET_ERROR;
-
-	//free memory, this will also free internal memory
-	bitmap_destroy(inode_map);
+	if(inode_id == FREEMAP_GET_ERROR){
+		freemap_unreserve(&freemap_free_inodes_cnt,1);
+		return FREEMAP_GET_ERROR;
+	}
+	__atomic_store_n(&freemap_meta_dirty,true,__ATOMIC_RELEASE);
 
 	return inode_id;
 }
@@ -232,47 +318,268 @@ uint32_t freemap_get_inode(){
 void freemap_free_inode(uint32_t inode){
 	struct block *d = block_get_role(BLOCK_FILESYS);
 	struct ext2_meta_data *meta = NULL;
-	struct bg_desc_table *bg_desc = NULL;
+	struct freemap_group *group = NULL;
 	struct bitmap *inode_map = NULL;
-	uint32_t block_size = 0, bg_group = 0;
+	uint32_t bg_group = 0;
 	uint32_t local_idx;
 
-	ASSERT(d != NULL);
+	ASSERT(d != NULL && freemap_groups != NULL);
 
 	meta = ext2_get_meta(d);
 	ASSERT(meta != NULL && meta->sb != NULL && meta->bg_desc_tabs != NULL);
-	block_size = ext2_get_block_size(meta->sb);
 
 	// Get block group, note: inodes start from 1.
 	bg_group = (inode - 1) / meta->sb->s_inodes_per_group;
-	bg_desc = &(meta->bg_desc_tabs[bg_group]);
+	ASSERT(bg_group < freemap_group_cnt);
+	group = &freemap_groups[bg_group];
 
 	// Calculate local index, note: inodes start from 1.
 	local_idx = (inode - 1) % meta->sb->s_inodes_per_group;
 
 	// Acquire lock
-	lock_acquire(&freemap_lock);
+	lock_acquire(&group->lock);
 
 	// Block group is found
-	inode_map = ext2_read_bitmap(d,bg_desc->bg_inode_bitmap);
+	inode_map = freemap_inode_map(d,meta,bg_group);
 	ASSERT(bitmap_all(inode_map,local_idx,1));
 
 	// Set bit to false
 	bitmap_set_multiple(inode_map,local_idx,1,false);
 
 	// Update statistics
-	meta->sb->s_free_inodes_count ++;
-	bg_desc->bg_free_inodes_count ++;
-	// Write bitmap to disk
-	ext2_write_block(d,bg_desc->bg_inode_bitmap,block_size,bitmap_get_bits(inode_map));
-	// Write superblock
-	ext2_write_superblock(d,meta->sb);
-	// Write block group description table
-	ext2_write_bg_desc_tables(d,meta->bg_desc_tabs);	
+	meta->bg_desc_tabs[bg_group].bg_free_inodes_count ++;
+	// Bitmap is written by freemap_flush()
+	group->inode_dirty = true;
 
 	// release lock
-	lock_release(&freemap_lock);
+	lock_release(&group->lock);
+
+	freemap_unreserve(&freemap_free_inodes_cnt,1);
+	__atomic_store_n(&freemap_meta_dirty,true,__ATOMIC_RELEASE);
+}
+
+/* Allocate a run of MIN to *BLOCKS contiguous blocks near GOAL,
+ * see freemap_get_blocks_goal(). *BLOCKS is set to the run length.
+*/
+static uint32_t freemap_get_range(uint32_t goal,uint32_t min,uint32_t *blocks,bool zero){
+	int i;
+	struct block *d = block_get_role(BLOCK_FILESYS);
+	struct ext2_meta_data *meta = NULL;
+	uint32_t block_size = 0, bg_groups = 0, goal_group = 1, goal_idx = 0;
+	bool has_goal = false;
+	uint32_t dist, bg_group, max, reserved;
+	uint32_t block_id = FREEMAP_GET_ERROR;
 
-	//free memory, this will also free internal memory
-	bitmap_destroy(inode_map);
+	ASSERT(min > 0 && min <= *blocks);
+	ASSERT(d != NULL && freemap_groups != NULL);
+
+	meta = ext2_get_meta(d);
+	ASSERT(meta != NULL && meta->sb != NULL && meta->bg_desc_tabs != NULL);
+	block_size = ext2_get_block_size(meta->sb);
+
+	// A run never spans block groups
+	max = *blocks;
+	if(max > meta->sb->s_blocks_per_group) max = meta->sb->s_blocks_per_group;
+	if(min > max) return FREEMAP_GET_ERROR;
+
+	// Reserve blocks, fails if there are not enough free blocks
+	reserved = freemap_reserve(&freemap_free_blocks_cnt,min,max);
+	if(reserved == 0) return FREEMAP_GET_ERROR;
+	*blocks = reserved;
+
+	// Get block groups, the first group is not used for data
+	bg_groups = meta->sb->s_blocks_count / meta->sb->s_blocks_per_group;
+
+	// Locate goal, for details on the offset see freemap_alloc_blocks().
+	// Block 0 is a data block with 4 KiB blocks, but still means no goal.
+	if(goal != 0 && goal >= meta->sb->s_first_data_block && goal < meta->sb->s_blocks_count){
+		has_goal = true;
+		goal -= meta->sb->s_first_data_block;
+		goal_group = goal / meta->sb->s_blocks_per_group;
+		goal_idx = goal % meta->sb->s_blocks_per_group;
+		// Goal in an unused group, keep the offset in the nearest one
+		if(goal_group < 1 || goal_group >= bg_groups)
+			goal_group = goal_group < 1 || bg_groups < 2 ? 1 : bg_groups - 1;
+	}
+
+	// Search goal group from the goal
+	if(goal_group < bg_groups)
+		block_id = freemap_alloc_blocks(d,meta,goal_group,min,blocks,goal_idx,has_goal);
+
+	// Search outwards, alternating after and before the goal group
+	for(dist = 1; block_id == FREEMAP_GET_ERROR && dist < bg_groups; dist++){
+		bg_group = goal_group + dist;
+		if(bg_group < bg_groups){
+			block_id = freemap_alloc_blocks(d,meta,bg_group,min,blocks,0,false);
+			if(block_id != FREEMAP_GET_ERROR) break;
+		}
+		if(goal_group > dist){
+			bg_group = goal_group - dist;
+			block_id = freemap_alloc_blocks(d,meta,bg_group,min,blocks,0,false);
+		}
+	}
+
+	// Check if successful
+	if(block_id == FREEMAP_GET_ERROR){
+		freemap_unreserve(&freemap_free_blocks_cnt,reserved);
+		return FREEMAP_GET_ERROR;
+	}
+	// Return reservation the run did not use
+	if(*blocks < reserved) freemap_unreserve(&freemap_free_blocks_cnt,reserved - *blocks);
+	__atomic_store_n(&freemap_meta_dirty,true,__ATOMIC_RELEASE);
+
+	// Zero newly allotted blocks
+	if(zero){
+		struct cache_block *b;
+		for(i = 0; i < *blocks; i++){
+			b = cache_get(d,block_id+i,false);
+			memset(cache_data(b),0,block_size);
+			cache_mark_dirty(b);
+			cache_put(b);
+		}
+	}
+
+	return block_id;
+}
+/* Order extents by first block */
+static int freemap_compare_extent(const void *a, const void *b){
+	const struct freemap_extent *x = a, *y = b;
+
+	if(x->start < y->start) return -1;
+	return x->start > y->start;
+}
+/* Take between MIN and MAX from free COUNTER, as much as is left.
+ * Returns the amount taken, 0 if fewer than MIN are left.
+*/
+static uint32_t freemap_reserve(uint32_t *counter, uint32_t min, uint32_t max){
+	uint32_t cur = __atomic_load_n(counter,__ATOMIC_RELAXED);
+	uint32_t n;
+
+	do{
+		if(cur < min) return 0;
+		n = cur < max ? cur : max;
+	} while(!__atomic_compare_exchange_n(counter,&cur,cur - n,true,__ATOMIC_ACQ_REL,__ATOMIC_RELAXED));
+
+	return n;
+}
+/* Give N back to free COUNTER */
+static void freemap_unreserve(uint32_t *counter, uint32_t n){
+	__atomic_add_fetch(counter,n,__ATOMIC_ACQ_REL);
+}
+/* Allocate MIN to *BLOCKS contiguous blocks in BG_GROUP, at or after
+ * local index START if possible. With GOAL, START is where the caller
+ * wants to continue, and a free area is looked for if it is taken.
+ * Returns the first block id and sets *BLOCKS to the run length.
+*/
+static uint32_t freemap_alloc_blocks(struct block *d, struct ext2_meta_data *meta, uint32_t bg_group, uint32_t min, uint32_t *blocks, uint32_t start, bool goal){
+	struct freemap_group *group = &freemap_groups[bg_group];
+	struct bg_desc_table *bg_desc = &(meta->bg_desc_tabs[bg_group]);
+	uint32_t block_id = BITMAP_ERROR;
+	uint32_t cnt = 0, limit;
+
+	// Unlocked check, skips full groups without taking their lock
+	if(__atomic_load_n(&bg_desc->bg_free_blocks_count,__ATOMIC_RELAXED) < min) return FREEMAP_GET_ERROR;
+
+	lock_acquire(&group->lock);
+	if(bg_desc->bg_free_blocks_count >= min){
+		struct bitmap *block_map = freemap_block_map(d,meta,bg_group);
+		uint32_t area = FREEMAP_FREE_RUN + min + FREEMAP_FREE_RUN;
+		// Goal is free: continue right there
+		if(goal && bitmap_scan(block_map,start,min,false) == start)
+			block_id = start;
+		/* Otherwise start in a free area, FREEMAP_FREE_RUN blocks in.
+		 * This leaves room for the file owning the blocks before the area,
+		 * and for this file to grow.
+		*/
+		if(goal && block_id == BITMAP_ERROR){
+			block_id = bitmap_scan(block_map,start,area,false);
+			if(block_id == BITMAP_ERROR && start > 0)
+				block_id = bitmap_scan(block_map,0,area,false);
+			if(block_id != BITMAP_ERROR) block_id += FREEMAP_FREE_RUN;
+		}
+		// Any space that fits
+		if(block_id == BITMAP_ERROR)
+			block_id = bitmap_scan(block_map,start,min,false);
+		if(block_id == BITMAP_ERROR && start > 0)
+			block_id = bitmap_scan(block_map,0,min,false);
+		if(block_id != BITMAP_ERROR){
+			// Extend the run as far as it is free
+			limit = meta->sb->s_blocks_per_group;
+			if(limit > bitmap_size(block_map)) limit = bitmap_size(block_map);
+			for(cnt = min; cnt < *blocks && block_id + cnt < limit; cnt++)
+				if(bitmap_all(block_map,block_id + cnt,1)) break;
+			bitmap_set_multiple(block_map,block_id,cnt,true);
+			bg_desc->bg_free_blocks_count -= cnt;
+			// Bitmap is written by freemap_flush()
+			group->block_dirty = true;
+		}
+	}
+	lock_release(&group->lock);
+
+	if(block_id == BITMAP_ERROR) return FREEMAP_GET_ERROR;
+	*blocks = cnt;
+
+	// Important: offset by the block group.
+	block_id += bg_group * meta->sb->s_blocks_per_group;
+	/* Important: bit 0 of byte 0 represent the first block of the block group.
+	 * superblock is the first block of block group 0,
+	 * but it is actually located at s_first_data_block.
+	 * Hence, one must offset s_first_data_block in block id calculation.
+	*/
+	block_id += meta->sb->s_first_data_block;
+
+	return block_id;
+}
+/* Allocate one inode in BG_GROUP, returns its inode number */
+static uint32_t freemap_alloc_inode(struct block *d, struct ext2_meta_data *meta, uint32_t bg_group){
+	struct freemap_group *group = &freemap_groups[bg_group];
+	struct bg_desc_table *bg_desc = &(meta->bg_desc_tabs[bg_group]);
+	uint32_t inode_id = BITMAP_ERROR;
+
+	// Unlocked check, skips full groups without taking their lock
+	if(__atomic_load_n(&bg_desc->bg_free_inodes_count,__ATOMIC_RELAXED) == 0) return FREEMAP_GET_ERROR;
+
+	lock_acquire(&group->lock);
+	if(bg_desc->bg_free_inodes_count > 0){
+		inode_id = bitmap_scan_and_flip (freemap_inode_map(d,meta,bg_group),0,1,false);
+		if(inode_id != BITMAP_ERROR){
+			bg_desc->bg_free_inodes_count --;
+			// Bitmap is written by freemap_flush()
+			group->inode_dirty = true;
+		}
+	}
+	lock_release(&group->lock);
+
+	if(inode_id == BITMAP_ERROR) return FREEMAP_GET_ERROR;
+
+	// Important: offset by the block group.
+	inode_id += bg_group * meta->sb->s_inodes_per_group;
+	// Inode Number starts from 1
+	inode_id ++;
+
+	return inode_id;
+}
+/* Get block bitmap of BG_GROUP, read from disk on first use.
+ * Group lock must be held.
+*/
+static struct bitmap *freemap_block_map(struct block *d, struct ext2_meta_data *meta, uint32_t bg_group){
+	struct freemap_group *group = &freemap_groups[bg_group];
+
+	ASSERT(lock_held_by_current_thread(&group->lock));
+	if(group->block_map == NULL)
+		group->block_map = ext2_read_bitmap(d,meta->bg_desc_tabs[bg_group].bg_block_bitmap);
+	ASSERT(group->block_map != NULL);
+	return group->block_map;
+}
+/* Get inode bitmap of BG_GROUP, read from disk on first use.
+ * Group lock must be held.
+*/
+static struct bitmap *freemap_inode_map(struct block *d, struct ext2_meta_data *meta, uint32_t bg_group){
+	struct freemap_group *group = &freemap_groups[bg_group];
+
+	ASSERT(lock_held_by_current_thread(&group->lock));
+	if(group->inode_map == NULL)
+		group->inode_map = ext2_read_bitmap(d,meta->bg_desc_tabs[bg_group].bg_inode_bitmap);
+	ASSERT(group->inode_map != NULL);
+	return group->inode_map;
 }
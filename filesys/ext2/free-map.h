@@ -3,14 +3,28 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include <stddef.h>
 
 #define FREEMAP_GET_ERROR UINT32_MAX
 
+// run of contiguous blocks
+struct freemap_extent {
+	uint32_t start;
+	uint32_t count;
+};
+
 void freemap_init();
+void freemap_load();
+void freemap_flush();
+void freemap_done();
 uint32_t freemap_get_block(bool);
 uint32_t freemap_get_blocks(uint32_t,bool);
+uint32_t freemap_get_blocks_goal(uint32_t,uint32_t,bool);
+uint32_t freemap_get_run(uint32_t,uint32_t*,bool);
+uint32_t freemap_inode_goal(uint32_t);
 void freemap_free_block(uint32_t);
 void freemap_free_blocks(uint32_t,uint32_t);
+void freemap_free_extents(struct freemap_extent*,size_t);
 uint32_t freemap_get_inode(void);
 void freemap_free_inode(uint32_t);
 
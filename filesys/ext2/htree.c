@@ -0,0 +1,766 @@
+#include "filesys/ext2/htree.h"
+#include "filesys/ext2/directory.h"
+#include "filesys/ext2/inode.h"
+#include "filesys/ext2/ext2.h"
+#include "filesys/ext2/superblock.h"
+#include "filesys/ext2/cache.h"
+#include "devices/block.h"
+#include "kernel/kmalloc.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <debug.h>
+
+/*
+ * Hash indexed directories, in the dir_index (HTree) format of ext3/ext4.
+ * Block 0 of an indexed directory holds "." and "..", the last one
+ * spanning the rest of the block, followed by the index root. Index
+ * entries map the lowest hash of a range to the directory block holding
+ * the names of that range, either a leaf of ordinary entries or, with
+ * indirect levels, an index node that looks like one empty entry.
+ * Bit 0 of an index hash is set when the names of that hash continue from
+ * the block before. As every index block looks like ordinary entries the
+ * directory stays readable by code that ignores the index.
+ * Index nodes are split when full and the root gains one indirect level,
+ * beyond that the directory is full like in Linux without largedir.
+*/
+
+#define HTREE_MAX_DEPTH 3 // index blocks on a path, root included
+#define HTREE_ROOT_INFO 24 // offset of the root info in block 0
+#define HTREE_ROOT_ENTRIES 32 // offset of the root entries in block 0
+#define HTREE_NODE_ENTRIES 8 // offset of the entries in an index node
+#define HTREE_BLOCK_MASK 0x0fffffff // directory block bits of an entry
+#define HTREE_EOF 0x7fffffffu // reserved hash, end of directory in readdir
+
+// index root header, after "." and ".."
+struct htree_root_info {
+	uint32_t reserved_zero;
+	uint8_t hash_version;
+	uint8_t info_length;	// 8
+	uint8_t indirect_levels;
+	uint8_t unused_flags;
+} __attribute__((packed));
+
+// index entry, the hash of the first one is replaced by struct htree_countlimit
+struct htree_entry {
+	uint32_t hash;
+	uint32_t block;
+} __attribute__((packed));
+
+struct htree_countlimit {
+	uint16_t limit;
+	uint16_t count;
+} __attribute__((packed));
+
+// one index block on the path to a leaf
+struct htree_frame {
+	struct cache_block *b;
+	struct htree_entry *entries;
+	struct htree_entry *at;		// entry followed to the next level
+};
+
+// path from the root to the leaf of a hash
+struct htree_path {
+	struct htree_frame frames[HTREE_MAX_DEPTH];
+	int depth;
+	uint32_t hash;
+	uint32_t block_size;
+};
+
+// entry of a leaf being split
+struct htree_map {
+	uint32_t hash;
+	uint16_t offset;
+	uint16_t size;
+};
+
+static uint32_t htree_hash(struct superblock *sb, uint8_t version, const char *name, size_t len);
+static void htree_str2hashbuf(const char *msg, size_t len, uint32_t *buf, int num, bool is_unsigned);
+static void htree_md4_transform(uint32_t buf[4], const uint32_t in[8]);
+static void htree_tea_transform(uint32_t buf[4], const uint32_t in[4]);
+static uint32_t htree_legacy_hash(const char *name, size_t len, bool is_unsigned);
+
+static int htree_probe(struct block *d, struct inode *dir, const char *name, size_t len, struct htree_path *path);
+static int htree_lookup(struct block *d, struct inode *dir, const char *name, size_t len, struct directory *entry);
+static bool htree_next_leaf(struct block *d, struct inode *dir, struct htree_path *path);
+static void htree_release(struct htree_path *path);
+static struct cache_block *htree_get_block(struct block *d, struct inode *dir, uint32_t logical);
+static int htree_grow_index(struct block *d, uint32_t dir_ino, struct inode *dir, struct htree_path *path);
+static int htree_split_leaf(struct block *d, uint32_t dir_ino, struct inode *dir, struct htree_path *path, struct cache_block *leaf, const char *name, size_t len, uint32_t ino, uint8_t type);
+static void htree_insert_index(struct htree_frame *f, uint32_t hash, uint32_t block);
+static void htree_fill_leaf(uint8_t *dst, uint32_t block_size, const uint8_t *src, struct htree_map *map, int cnt);
+static int htree_compare_map(const void *a, const void *b);
+
+static inline struct htree_countlimit *htree_countlimit(struct htree_entry *entries){
+	return (struct htree_countlimit*)entries;
+}
+static inline uint32_t htree_root_limit(uint32_t block_size){
+	return (block_size - HTREE_ROOT_ENTRIES) / sizeof(struct htree_entry);
+}
+static inline uint32_t htree_node_limit(uint32_t block_size){
+	return (block_size - HTREE_NODE_ENTRIES) / sizeof(struct htree_entry);
+}
+
+/* Directory DIR of device D has a usable hash index */
+bool htree_indexed(struct block *d, struct inode *dir){
+	struct ext2_meta_data *meta = ext2_get_meta(d);
+
+	ASSERT(meta != NULL && meta->sb != NULL);
+	return (dir->i_flags & EXT2_INDEX_FL) != 0
+		&& (meta->sb->s_feature_compat & EXT2_FEATURE_COMPAT_DIR_INDEX) != 0;
+}
+/* Directory DIR may be turned into an indexed one by htree_create() */
+bool htree_can_index(struct block *d, struct inode *dir){
+	struct ext2_meta_data *meta = ext2_get_meta(d);
+
+	ASSERT(meta != NULL && meta->sb != NULL);
+	return (dir->i_flags & EXT2_INDEX_FL) == 0
+		&& (meta->sb->s_feature_compat & EXT2_FEATURE_COMPAT_DIR_INDEX) != 0
+		&& meta->sb->s_def_hash_version <= EXT2_HASH_TEA
+		&& dir->i_size == ext2_get_block_size(meta->sb);
+}
+
+/* Index the one block directory DIR, inode DIR_INO. Its entries but "."
+ * and ".." move to a new leaf block and block 0 becomes the index root.
+ * Returns 0 on success, -1 on failure.
+*/
+int htree_create(struct block *d, uint32_t dir_ino, struct inode *dir){
+	struct ext2_meta_data *meta;
+	struct cache_block *root_b, *leaf_b;
+	struct directory *dot, *dotdot, *cur;
+	struct htree_root_info *info;
+	struct htree_entry *entries;
+	struct htree_map *map;
+	uint8_t *copy, *data;
+	uint32_t block_size, pos, logical;
+	int cnt = 0, err = -1;
+
+	ASSERT(d != NULL && dir != NULL);
+
+	meta = ext2_get_meta(d);
+	block_size = ext2_get_block_size(meta->sb);
+
+	inode_lock(dir);
+	if(!htree_can_index(d,dir)) goto done;
+
+	root_b = htree_get_block(d,dir,0);
+	if(root_b == NULL) goto done;
+	data = cache_data(root_b);
+
+	// "." and ".." come first
+	dot = (struct directory*)data;
+	if(dot->rec_len < DIR_ENTRY_LEN(1) || dot->rec_len > block_size - DIR_ENTRY_LEN(2)
+		|| dot->name_len != 1 || dot->name[0] != '.') goto put_root;
+	dotdot = (struct directory*)(data + dot->rec_len);
+	if(dotdot->rec_len < DIR_ENTRY_LEN(2) || dot->rec_len + dotdot->rec_len > block_size
+		|| dotdot->name_len != 2 || memcmp(dotdot->name,"..",2) != 0) goto put_root;
+
+	copy = kmalloc(block_size);
+	map = kmalloc(block_size / DIR_ENTRY_LEN(1) * sizeof(struct htree_map));
+	if(copy == NULL || map == NULL) goto free_copy;
+	memcpy(copy,data,block_size);
+
+	// Collect the other entries
+	for(pos = dot->rec_len + dotdot->rec_len; pos + DIR_ENTRY_LEN(0) <= block_size; pos += cur->rec_len){
+		cur = (struct directory*)(copy + pos);
+		if(cur->rec_len < DIR_ENTRY_LEN(0) || pos + cur->rec_len > block_size) break;
+		if(cur->inode == 0) continue;
+		map[cnt].offset = pos;
+		map[cnt].size = DIR_ENTRY_LEN(cur->name_len);
+		cnt++;
+	}
+
+	// Move them to the first leaf
+	leaf_b = dir_append_block(d,dir_ino,dir,&logical);
+	if(leaf_b == NULL) goto free_copy;
+	ASSERT(logical == 1);
+	htree_fill_leaf(cache_data(leaf_b),block_size,copy,map,cnt);
+	cache_mark_dirty(leaf_b);
+	cache_put(leaf_b);
+
+	// Block 0 becomes the root
+	dotdot = (struct directory*)(data + DIR_ENTRY_LEN(1));
+	memmove(dotdot,copy + dot->rec_len,DIR_ENTRY_LEN(2));
+	dot->rec_len = DIR_ENTRY_LEN(1);
+	dotdot->rec_len = block_size - DIR_ENTRY_LEN(1);
+	memset(data + HTREE_ROOT_INFO,0,block_size - HTREE_ROOT_INFO);
+	info = (struct htree_root_info*)(data + HTREE_ROOT_INFO);
+	info->hash_version = meta->sb->s_def_hash_version;
+	info->info_length = sizeof(struct htree_root_info);
+	entries = (struct htree_entry*)(data + HTREE_ROOT_ENTRIES);
+	htree_countlimit(entries)->limit = htree_root_limit(block_size);
+	htree_countlimit(entries)->count = 1;
+	entries[0].block = logical;
+	cache_mark_dirty(root_b);
+
+	dir->i_flags |= EXT2_INDEX_FL;
+	inode_mark_dirty(dir);
+	err = 0;
+
+free_copy:
+	if(copy != NULL) kfree(copy);
+	if(map != NULL) kfree(map);
+put_root:
+	cache_put(root_b);
+done:
+	inode_unlock(dir);
+	return err;
+}
+
+/* Find entry NAME of LEN bytes in indexed directory DIR through the index
+ * and copy it to ENTRY. Returns 0 on success, DIR_NOT_FOUND if there is
+ * no such entry and -1 if DIR has no usable index.
+*/
+int htree_find(struct block *d, struct inode *dir, const char *name, size_t len, struct directory *entry){
+	int err;
+
+	ASSERT(d != NULL && dir != NULL && entry != NULL);
+	if(!htree_indexed(d,dir)) return -1;
+
+	inode_lock_shared(dir);
+	err = htree_lookup(d,dir,name,len,entry);
+	inode_unlock_shared(dir);
+
+	return err;
+}
+
+/* Add entry NAME for inode INO of TYPE to indexed directory DIR, inode
+ * DIR_INO. A full leaf is split in two by hash. Returns 0 on success,
+ * -1 on failure.
+*/
+int htree_add_entry(struct block *d, uint32_t dir_ino, struct inode *dir, const char *name, size_t len, uint32_t ino, uint8_t type){
+	struct htree_path path;
+	struct cache_block *leaf;
+	int err = -1;
+
+	ASSERT(d != NULL && dir != NULL && name != NULL);
+	if(len == 0 || len > UINT8_MAX || !htree_indexed(d,dir)) return -1;
+
+	inode_lock(dir);
+	// Names are unique, checked under the lock against concurrent adds
+	if(htree_lookup(d,dir,name,len,NULL) != DIR_NOT_FOUND) goto done;
+	if(htree_probe(d,dir,name,len,&path) < 0) goto done;
+	leaf = htree_get_block(d,dir,path.frames[path.depth-1].at->block & HTREE_BLOCK_MASK);
+	if(leaf == NULL) goto release;
+
+	// Common case, the leaf has room
+	if(dir_insert_in_block(cache_data(leaf),path.block_size,name,len,ino,type)){
+		cache_mark_dirty(leaf);
+		err = 0;
+	}
+	// Otherwise the leaf is split, the index needs room for it
+	else if(htree_grow_index(d,dir_ino,dir,&path) == 0)
+		err = htree_split_leaf(d,dir_ino,dir,&path,leaf,name,len,ino,type);
+	else
+		printf("htree: directory index of inode %u is full.\n",dir_ino);
+	cache_put(leaf);
+
+release:
+	htree_release(&path);
+done:
+	inode_unlock(dir);
+	return err;
+}
+
+/* Remove entry NAME from indexed directory DIR and store its inode in INO.
+ * Returns 0 on success, DIR_NOT_FOUND if there is no such entry and -1 if
+ * DIR has no usable index.
+*/
+int htree_remove_entry(struct block *d, struct inode *dir, const char *name, size_t len, uint32_t *ino){
+	struct htree_path path;
+	struct cache_block *leaf;
+	bool removed = false;
+	int err = DIR_NOT_FOUND;
+
+	ASSERT(d != NULL && dir != NULL);
+	if(!htree_indexed(d,dir)) return -1;
+
+	inode_lock(dir);
+	if(htree_probe(d,dir,name,len,&path) < 0){
+		inode_unlock(dir);
+		return -1;
+	}
+	do {
+		leaf = htree_get_block(d,dir,path.frames[path.depth-1].at->block & HTREE_BLOCK_MASK);
+		if(leaf == NULL){
+			err = -1;
+			break;
+		}
+		removed = dir_remove_in_block(cache_data(leaf),path.block_size,name,len,ino);
+		if(removed){
+			cache_mark_dirty(leaf);
+			err = 0;
+		}
+		cache_put(leaf);
+	} while(!removed && htree_next_leaf(d,dir,&path));
+	htree_release(&path);
+	inode_unlock(dir);
+
+	return err;
+}
+
+/* Find entry NAME of LEN bytes in indexed directory DIR, locked by the
+ * caller, and copy it to ENTRY unless it is NULL. Returns 0 on success,
+ * DIR_NOT_FOUND if there is no such entry and -1 on failure.
+*/
+static int htree_lookup(struct block *d, struct inode *dir, const char *name, size_t len, struct directory *entry){
+	struct htree_path path;
+	struct cache_block *leaf;
+	struct directory *found = NULL;
+	int err = DIR_NOT_FOUND;
+
+	if(htree_probe(d,dir,name,len,&path) < 0) return -1;
+	do {
+		leaf = htree_get_block(d,dir,path.frames[path.depth-1].at->block & HTREE_BLOCK_MASK);
+		if(leaf == NULL){
+			err = -1;
+			break;
+		}
+		found = dir_find_in_block(cache_data(leaf),path.block_size,name,len);
+		if(found != NULL){
+			if(entry != NULL){
+				memset(entry,0,sizeof(struct directory));
+				memcpy(entry,found,DIR_ENTRY_LEN(0) + found->name_len);
+				entry->rec_len = DIR_ENTRY_LEN(found->name_len);
+			}
+			err = 0;
+		}
+		cache_put(leaf);
+	} while(found == NULL && htree_next_leaf(d,dir,&path));
+	htree_release(&path);
+
+	return err;
+}
+/* Walk the index of DIR from the root to the leaf holding NAME.
+ * Returns 0 on success, -1 if the index is damaged or of an unknown kind.
+*/
+static int htree_probe(struct block *d, struct inode *dir, const char *name, size_t len, struct htree_path *path){
+	struct ext2_meta_data *meta;
+	struct htree_root_info *info;
+	struct htree_frame *f;
+	struct htree_entry *p, *q, *m;
+	uint32_t count, limit, levels;
+	uint8_t *data;
+
+	meta = ext2_get_meta(d);
+	ASSERT(meta != NULL && meta->sb != NULL);
+	path->block_size = ext2_get_block_size(meta->sb);
+	path->depth = 0;
+
+	for(;;){
+		f = &path->frames[path->depth];
+		f->b = htree_get_block(d,dir,path->depth == 0 ? 0 : path->frames[path->depth-1].at->block & HTREE_BLOCK_MASK);
+		if(f->b == NULL) goto fail;
+		path->depth++;
+		data = cache_data(f->b);
+
+		if(path->depth == 1){
+			// Root, check its header and hash the name
+			info = (struct htree_root_info*)(data + HTREE_ROOT_INFO);
+			if(info->reserved_zero != 0 || info->info_length != sizeof(struct htree_root_info)
+				|| info->hash_version > EXT2_HASH_TEA || info->indirect_levels >= HTREE_MAX_DEPTH)
+				goto fail;
+			levels = info->indirect_levels;
+			path->hash = htree_hash(meta->sb,info->hash_version,name,len);
+			f->entries = (struct htree_entry*)(data + HTREE_ROOT_ENTRIES);
+			limit = htree_root_limit(path->block_size);
+		}
+		else{
+			f->entries = (struct htree_entry*)(data + HTREE_NODE_ENTRIES);
+			limit = htree_node_limit(path->block_size);
+		}
+		count = htree_countlimit(f->entries)->count;
+		if(htree_countlimit(f->entries)->limit != limit || count == 0 || count > limit) goto fail;
+
+		// Last entry with a hash not above the name's
+		p = f->entries + 1;
+		q = f->entries + count - 1;
+		while(p <= q){
+			m = p + (q - p) / 2;
+			if(m->hash > path->hash) q = m - 1;
+			else p = m + 1;
+		}
+		f->at = p - 1;
+
+		if(path->depth > (int)levels) return 0;
+	}
+
+fail:
+	htree_release(path);
+	return -1;
+}
+/* Move PATH to the next leaf if names of its hash may continue there */
+static bool htree_next_leaf(struct block *d, struct inode *dir, struct htree_path *path){
+	struct htree_frame *f;
+	struct htree_entry *entries;
+	int level, i;
+
+	// Deepest level that has another entry
+	for(level = path->depth - 1; level >= 0; level--){
+		f = &path->frames[level];
+		if(f->at + 1 < f->entries + htree_countlimit(f->entries)->count) break;
+	}
+	if(level < 0) return false;
+	f = &path->frames[level];
+	if(((f->at + 1)->hash & ~1u) != path->hash) return false;
+	f->at++;
+
+	// Follow the first entries down again
+	for(level++; level < path->depth; level++){
+		f = &path->frames[level];
+		cache_put(f->b);
+		f->b = htree_get_block(d,dir,path->frames[level-1].at->block & HTREE_BLOCK_MASK);
+		entries = f->b == NULL ? NULL : (struct htree_entry*)((uint8_t*)cache_data(f->b) + HTREE_NODE_ENTRIES);
+		if(entries == NULL || htree_countlimit(entries)->count == 0){
+			// Damaged index, drop this frame and the ones below
+			if(f->b != NULL) cache_put(f->b);
+			for(i = level + 1; i < path->depth; i++) cache_put(path->frames[i].b);
+			path->depth = level;
+			return false;
+		}
+		f->entries = entries;
+		f->at = entries;
+	}
+	return true;
+}
+/* Return the index blocks of PATH */
+static void htree_release(struct htree_path *path){
+	int i;
+
+	for(i = 0; i < path->depth; i++) cache_put(path->frames[i].b);
+	path->depth = 0;
+}
+
+/* Borrow block LOGICAL of directory DIR, NULL if it does not exist */
+static struct cache_block *htree_get_block(struct block *d, struct inode *dir, uint32_t logical){
+	struct inode_extent extent;
+	struct ext2_meta_data *meta = ext2_get_meta(d);
+
+	if((uint64_t)logical * ext2_get_block_size(meta->sb) >= dir->i_size) return NULL;
+	if(inode_map_range(d,dir,logical,1,&extent,1) != 1 || extent.physical == 0) return NULL;
+	return cache_get(d,extent.physical,true);
+}
+/* Make room for one more entry in the deepest index block of PATH, by
+ * adding an indirect level below a full root or splitting a full node.
+ * Returns 0 on success, -1 if the index cannot grow.
+*/
+static int htree_grow_index(struct block *d, uint32_t dir_ino, struct inode *dir, struct htree_path *path){
+	struct htree_frame *f = &path->frames[path->depth-1], *parent;
+	struct htree_root_info *info;
+	struct htree_entry *entries;
+	struct cache_block *b;
+	struct directory *fake;
+	uint32_t count, half, logical, bs = path->block_size;
+
+	count = htree_countlimit(f->entries)->count;
+	if(count < htree_countlimit(f->entries)->limit) return 0;
+
+	if(path->depth == 1){
+		// Root is full, its entries move to a new node below it
+		b = dir_append_block(d,dir_ino,dir,&logical);
+		if(b == NULL) return -1;
+		fake = cache_data(b);
+		fake->rec_len = bs;
+		entries = (struct htree_entry*)((uint8_t*)cache_data(b) + HTREE_NODE_ENTRIES);
+		memcpy(entries,f->entries,count * sizeof(struct htree_entry));
+		htree_countlimit(entries)->limit = htree_node_limit(bs);
+		htree_countlimit(entries)->count = count;
+		// Filled before the root points to it
+		cache_mark_dirty(b);
+
+		htree_countlimit(f->entries)->count = 1;
+		f->entries[0].block = logical;
+		info = (struct htree_root_info*)((uint8_t*)cache_data(f->b) + HTREE_ROOT_INFO);
+		info->indirect_levels = 1;
+		cache_mark_dirty(f->b);
+
+		path->frames[1].b = b;
+		path->frames[1].entries = entries;
+		path->frames[1].at = entries + (f->at - f->entries);
+		f->at = f->entries;
+		path->depth = 2;
+		return 0;
+	}
+
+	// Node is full, move its upper half to a new node if the parent has room
+	parent = &path->frames[path->depth-2];
+	if(htree_countlimit(parent->entries)->count >= htree_countlimit(parent->entries)->limit) return -1;
+	b = dir_append_block(d,dir_ino,dir,&logical);
+	if(b == NULL) return -1;
+	fake = cache_data(b);
+	fake->rec_len = bs;
+	entries = (struct htree_entry*)((uint8_t*)cache_data(b) + HTREE_NODE_ENTRIES);
+	half = count / 2;
+	memcpy(entries,f->entries + half,(count - half) * sizeof(struct htree_entry));
+	htree_insert_index(parent,f->entries[half].hash,logical);
+	htree_countlimit(entries)->limit = htree_node_limit(bs);
+	htree_countlimit(entries)->count = count - half;
+	htree_countlimit(f->entries)->count = half;
+	cache_mark_dirty(f->b);
+	cache_mark_dirty(b);
+
+	// Keep following the half holding the hash
+	if(f->at >= f->entries + half){
+		f->at = entries + (f->at - (f->entries + half));
+		cache_put(f->b);
+		f->b = b;
+		f->entries = entries;
+		parent->at++;
+	}
+	else cache_put(b);
+	return 0;
+}
+/* Split the full LEAF of PATH by hash, the upper half moves to a new
+ * block, and add entry NAME to the half it belongs to.
+ * The deepest index block of PATH must have room for one entry.
+ * Returns 0 on success, -1 on failure.
+*/
+static int htree_split_leaf(struct block *d, uint32_t dir_ino, struct inode *dir, struct htree_path *path, struct cache_block *leaf, const char *name, size_t len, uint32_t ino, uint8_t type){
+	struct ext2_meta_data *meta = ext2_get_meta(d);
+	struct htree_frame *f = &path->frames[path->depth-1];
+	struct cache_block *b, *target;
+	struct htree_root_info *info;
+	struct directory *cur;
+	struct htree_map *map;
+	uint8_t *copy, version;
+	uint32_t bs = path->block_size, pos, size, logical, hash2;
+	int cnt = 0, split, err = -1;
+
+	info = (struct htree_root_info*)((uint8_t*)cache_data(path->frames[0].b) + HTREE_ROOT_INFO);
+	version = info->hash_version;
+
+	copy = kmalloc(bs);
+	map = kmalloc(bs / DIR_ENTRY_LEN(1) * sizeof(struct htree_map));
+	if(copy == NULL || map == NULL) goto done;
+	memcpy(copy,cache_data(leaf),bs);
+
+	// Hash the entries of the leaf
+	for(pos = 0; pos + DIR_ENTRY_LEN(0) <= bs; pos += cur->rec_len){
+		cur = (struct directory*)(copy + pos);
+		if(cur->rec_len < DIR_ENTRY_LEN(0) || pos + cur->rec_len > bs) break;
+		if(cur->inode == 0) continue;
+		map[cnt].hash = htree_hash(meta->sb,version,(const char*)cur->name,cur->name_len);
+		map[cnt].offset = pos;
+		map[cnt].size = DIR_ENTRY_LEN(cur->name_len);
+		cnt++;
+	}
+	if(cnt < 2) goto done;
+	qsort(map,cnt,sizeof(struct htree_map),htree_compare_map);
+
+	// The upper half by size moves
+	size = 0;
+	for(split = cnt; split > 1; split--){
+		if(size + map[split-1].size / 2 > bs / 2) break;
+		size += map[split-1].size;
+	}
+	if(split == cnt) split = cnt - 1;
+	hash2 = map[split].hash;
+	// Equal hashes on both sides, mark the continuation
+	if(hash2 == map[split-1].hash) hash2 |= 1;
+
+	b = dir_append_block(d,dir_ino,dir,&logical);
+	if(b == NULL) goto done;
+	htree_fill_leaf(cache_data(leaf),bs,copy,map,split);
+	htree_fill_leaf(cache_data(b),bs,copy,map + split,cnt - split);
+	htree_insert_index(f,hash2,logical);
+	cache_mark_dirty(leaf);
+	cache_mark_dirty(b);
+
+	// Add the new entry where its hash belongs
+	target = path->hash >= (hash2 & ~1u) ? b : leaf;
+	if(dir_insert_in_block(cache_data(target),bs,name,len,ino,type)){
+		cache_mark_dirty(target);
+		err = 0;
+	}
+	cache_put(b);
+
+done:
+	if(copy != NULL) kfree(copy);
+	if(map != NULL) kfree(map);
+	return err;
+}
+/* Insert index entry HASH -> BLOCK after the followed entry of F */
+static void htree_insert_index(struct htree_frame *f, uint32_t hash, uint32_t block){
+	struct htree_countlimit *cl = htree_countlimit(f->entries);
+	struct htree_entry *next = f->at + 1;
+
+	ASSERT(cl->count < cl->limit);
+	memmove(next + 1,next,(f->entries + cl->count - next) * sizeof(struct htree_entry));
+	next->hash = hash;
+	next->block = block;
+	cl->count++;
+	cache_mark_dirty(f->b);
+}
+/* Write the CNT entries of MAP, found in block SRC, packed into leaf DST */
+static void htree_fill_leaf(uint8_t *dst, uint32_t block_size, const uint8_t *src, struct htree_map *map, int cnt){
+	struct directory *cur = NULL;
+	uint32_t pos = 0;
+	int i;
+
+	memset(dst,0,block_size);
+	for(i = 0; i < cnt; i++){
+		cur = (struct directory*)(dst + pos);
+		memcpy(cur,src + map[i].offset,map[i].size);
+		cur->rec_len = map[i].size;
+		pos += map[i].size;
+	}
+	// Last entry spans the rest of the block
+	if(cur == NULL) ((struct directory*)dst)->rec_len = block_size;
+	else cur->rec_len += block_size - pos;
+}
+static int htree_compare_map(const void *a, const void *b){
+	const struct htree_map *x = a, *y = b;
+
+	if(x->hash != y->hash) return x->hash < y->hash ? -1 : 1;
+	return 0;
+}
+
+/* Directory hash of NAME with hash VERSION and the seed of SB */
+static uint32_t htree_hash(struct superblock *sb, uint8_t version, const char *name, size_t len){
+	uint32_t buf[4], in[8], hash;
+	bool is_unsigned = (sb->s_flags & EXT2_FLAGS_UNSIGNED_HASH) != 0;
+	const char *p = name;
+	long left = len;
+	int i;
+
+	// Seed, or the MD4 initial values if there is none
+	buf[0] = 0x67452301;
+	buf[1] = 0xefcdab89;
+	buf[2] = 0x98badcfe;
+	buf[3] = 0x10325476;
+	for(i = 0; i < 4; i++){
+		if(sb->s_hash_seed[i] != 0){
+			memcpy(buf,sb->s_hash_seed,sizeof(buf));
+			break;
+		}
+	}
+
+	switch(version){
+		case EXT2_HASH_HALF_MD4:
+			for(; left > 0; left -= 32, p += 32){
+				htree_str2hashbuf(p,left,in,8,is_unsigned);
+				htree_md4_transform(buf,in);
+			}
+			hash = buf[1];
+			break;
+		case EXT2_HASH_TEA:
+			for(; left > 0; left -= 16, p += 16){
+				htree_str2hashbuf(p,left,in,4,is_unsigned);
+				htree_tea_transform(buf,in);
+			}
+			hash = buf[0];
+			break;
+		default:
+			hash = htree_legacy_hash(name,len,is_unsigned);
+			break;
+	}
+
+	// Bit 0 marks continued hashes, the last hash means end of directory
+	hash &= ~1u;
+	if(hash == (HTREE_EOF << 1)) hash = (HTREE_EOF - 1) << 1;
+	return hash;
+}
+/* Pack up to NUM*4 bytes of MSG into NUM words, padded with its length */
+static void htree_str2hashbuf(const char *msg, size_t len, uint32_t *buf, int num, bool is_unsigned){
+	uint32_t pad, val;
+	size_t i;
+	int c;
+
+	pad = (uint32_t)len | ((uint32_t)len << 8);
+	pad |= pad << 16;
+
+	val = pad;
+	if(len > (size_t)num * 4) len = num * 4;
+	for(i = 0; i < len; i++){
+		c = is_unsigned ? (int)(unsigned char)msg[i] : (int)(signed char)msg[i];
+		val = (uint32_t)c + (val << 8);
+		if((i % 4) == 3){
+			*buf++ = val;
+			val = pad;
+			num--;
+		}
+	}
+	if(--num >= 0) *buf++ = val;
+	while(--num >= 0) *buf++ = pad;
+}
+
+#define HTREE_ROL(x,s) (((x) << (s)) | ((x) >> (32 - (s))))
+#define HTREE_F(x,y,z) ((z) ^ ((x) & ((y) ^ (z))))
+#define HTREE_G(x,y,z) (((x) & (y)) + (((x) ^ (y)) & (z)))
+#define HTREE_H(x,y,z) ((x) ^ (y) ^ (z))
+#define HTREE_ROUND(f,a,b,c,d,x,s) (a += f(b,c,d) + (x), a = HTREE_ROL(a,s))
+#define HTREE_K2 013240474631UL
+#define HTREE_K3 015666365641UL
+
+/* Reduced MD4 compression of 8 words, as used by ext3 */
+static void htree_md4_transform(uint32_t buf[4], const uint32_t in[8]){
+	uint32_t a = buf[0], b = buf[1], c = buf[2], d = buf[3];
+
+	// Round 1
+	HTREE_ROUND(HTREE_F, a, b, c, d, in[0], 3);
+	HTREE_ROUND(HTREE_F, d, a, b, c, in[1], 7);
+	HTREE_ROUND(HTREE_F, c, d, a, b, in[2], 11);
+	HTREE_ROUND(HTREE_F, b, c, d, a, in[3], 19);
+	HTREE_ROUND(HTREE_F, a, b, c, d, in[4], 3);
+	HTREE_ROUND(HTREE_F, d, a, b, c, in[5], 7);
+	HTREE_ROUND(HTREE_F, c, d, a, b, in[6], 11);
+	HTREE_ROUND(HTREE_F, b, c, d, a, in[7], 19);
+
+	// Round 2
+	HTREE_ROUND(HTREE_G, a, b, c, d, in[1] + HTREE_K2, 3);
+	HTREE_ROUND(HTREE_G, d, a, b, c, in[3] + HTREE_K2, 5);
+	HTREE_ROUND(HTREE_G, c, d, a, b, in[5] + HTREE_K2, 9);
+	HTREE_ROUND(HTREE_G, b, c, d, a, in[7] + HTREE_K2, 13);
+	HTREE_ROUND(HTREE_G, a, b, c, d, in[0] + HTREE_K2, 3);
+	HTREE_ROUND(HTREE_G, d, a, b, c, in[2] + HTREE_K2, 5);
+	HTREE_ROUND(HTREE_G, c, d, a, b, in[4] + HTREE_K2, 9);
+	HTREE_ROUND(HTREE_G, b, c, d, a, in[6] + HTREE_K2, 13);
+
+	// Round 3
+	HTREE_ROUND(HTREE_H, a, b, c, d, in[3] + HTREE_K3, 3);
+	HTREE_ROUND(HTREE_H, d, a, b, c, in[7] + HTREE_K3, 9);
+	HTREE_ROUND(HTREE_H, c, d, a, b, in[2] + HTREE_K3, 11);
+	HTREE_ROUND(HTREE_H, b, c, d, a, in[6] + HTREE_K3, 15);
+	HTREE_ROUND(HTREE_H, a, b, c, d, in[1] + HTREE_K3, 3);
+	HTREE_ROUND(HTREE_H, d, a, b, c, in[5] + HTREE_K3, 9);
+	HTREE_ROUND(HTREE_H, c, d, a, b, in[0] + HTREE_K3, 11);
+	HTREE_ROUND(HTREE_H, b, c, d, a, in[4] + HTREE_K3, 15);
+
+	buf[0] += a;
+	buf[1] += b;
+	buf[2] += c;
+	buf[3] += d;
+}
+/* TEA block cipher of 4 words, 16 rounds */
+static void htree_tea_transform(uint32_t buf[4], const uint32_t in[4]){
+	uint32_t sum = 0, b0 = buf[0], b1 = buf[1];
+	uint32_t a = in[0], b = in[1], c = in[2], d = in[3];
+	int n = 16;
+
+	do {
+		sum += 0x9E3779B9;
+		b0 += ((b1 << 4) + a) ^ (b1 + sum) ^ ((b1 >> 5) + b);
+		b1 += ((b0 << 4) + c) ^ (b0 + sum) ^ ((b0 >> 5) + d);
+	} while(--n);
+
+	buf[0] += b0;
+	buf[1] += b1;
+}
+/* Hash of the first dir_index implementation */
+static uint32_t htree_legacy_hash(const char *name, size_t len, bool is_unsigned){
+	uint32_t hash, hash0 = 0x12a3fe2d, hash1 = 0x37abe8f9;
+	int c;
+
+	while(len--){
+		c = is_unsigned ? (int)(unsigned char)*name++ : (int)(signed char)*name++;
+		hash = hash1 + (hash0 ^ (uint32_t)(c * 7152373));
+		if(hash & 0x80000000) hash -= 0x7fffffff;
+		hash1 = hash0;
+		hash0 = hash;
+	}
+	return hash0 << 1;
+}
@@ -0,0 +1,19 @@
+#ifndef EXT2_HTREE_H
+#define EXT2_HTREE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "filesys/ext2/directory.h"
+#include "filesys/ext2/inode.h"
+#include "devices/block.h"
+
+// Hash indexed directories (dir_index)
+bool htree_indexed(struct block *d, struct inode *dir);
+bool htree_can_index(struct block *d, struct inode *dir);
+int htree_create(struct block *d, uint32_t dir_ino, struct inode *dir);
+int htree_find(struct block *d, struct inode *dir, const char *name, size_t len, struct directory *entry);
+int htree_add_entry(struct block *d, uint32_t dir_ino, struct inode *dir, const char *name, size_t len, uint32_t ino, uint8_t type);
+int htree_remove_entry(struct block *d, struct inode *dir, const char *name, size_t len, uint32_t *ino);
+
+#endif
@@ -3,10 +3,12 @@
 #include "filesys/ext2/superblock.h"
 #include "filesys/ext2/block_group.h"
 #include "filesys/ext2/free-map.h"
+#include "filesys/ext2/cache.h"
 #include "filesys/off_t.h"
 #include "devices/block.h"
 #include "kernel/kmalloc.h"
 #include "kernel/synch.h"
+#include "kernel/thread.h"
 
 #include <stddef.h>
 #include <stdint.h>
@@ -15,10 +17,117 @@
 #include <stdio.h>
 #include <debug.h>
 #include <round.h>
+#include <stdlib.h>
 #include <string.h>
 #include <bitmap.h>
+#include <list.h>
 
 #define DIRECT_BLOCKS 12
+#define INODE_MAP_BATCH 16 // extents resolved per inode_map_range() call
+#define INODE_ZERO_CHUNK 64 // blocks zeroed per device request
+#define INODE_RELEASE_BATCH 64 // runs of freed blocks returned at once
+
+// Block allocation state of one inode_fill_range() pass
+struct inode_alloc {
+	uint32_t goal;		// where the next run should start
+	uint32_t next;		// next free block of the current run
+	uint32_t left;		// blocks left in the current run
+	uint32_t want;		// blocks still expected to be needed
+	uint32_t allocated;	// blocks handed out
+	bool zero;			// zero new data blocks
+	uint32_t zero_start;	// data blocks pending zeroing
+	uint32_t zero_cnt;
+};
+
+#define INODE_CACHE_BUCKETS 64
+#define INODE_CACHE_UNUSED 64 // unused inodes kept cached
+
+/* In-core inode, shared by all users of the inode.
+ * Callers only see DATA, the on-disk inode.
+ * The inode lock is a readers/writer lock: readers of DATA and of the
+ * file contents hold it shared and run in parallel, changes hold it
+ * exclusively. Waiting writers keep new readers out so they cannot starve.
+ * Writes that change neither the size nor the block map hold it shared
+ * too, and lock the blocks they write in RANGES, see inode_write_at().
+*/
+struct inode_core {
+	struct block *device;
+	uint32_t ino;				// inode number
+	int open_cnt;				// number of references
+	bool dirty;					// DATA differs from the inode table
+	bool unlinked;				// freed once OPEN_CNT drops to 0
+	struct lock lock;			// guards the inode lock state below
+	struct condition unlocked;	// the inode lock was released
+	int readers;				// threads holding the inode lock shared
+	int writers_waiting;		// threads waiting to hold it exclusively
+	bool writer;				// a thread holds it exclusively
+	struct list ranges;			// blocks locked by in-place writes
+	struct list_elem elem;		// hash bucket element
+	struct list_elem lru_elem;	// unused list element, if OPEN_CNT is 0
+	struct list_elem dirty_elem;	// dirty list element, if DIRTY
+	uint32_t synced_size;		// i_size and i_block as of the last
+	uint32_t synced_block[15];	// inode_sync(), zero before the first
+	struct inode data;
+};
+
+// Blocks FIRST to LAST written in place by one inode_write_at()
+struct inode_range {
+	uint32_t first;
+	uint32_t last;
+	struct list_elem elem;		// inode_core ranges element
+};
+
+// Position in the buffers of a vectored transfer
+struct inode_iov {
+	const struct block_iovec *iov;	// current buffer
+	size_t cnt;		// buffers left, the current one included
+	size_t ofs;		// offset in the current buffer
+};
+
+// Range queued by inode_prefetch()
+struct inode_prefetch {
+	struct block *device;
+	struct inode *inode;	// reference held until the range is read
+	off_t offset;
+	off_t len;
+	struct list_elem elem;
+};
+
+// Dirty inode and its inode table location, see inode_flush_all()
+struct inode_flush {
+	struct inode_core *core;
+	uint32_t block_idx;
+	uint32_t block_offset;
+};
+
+static struct list inode_buckets[INODE_CACHE_BUCKETS];
+static struct list inode_unused; // unused inodes, least recently used first
+static struct list inode_dirty; // inodes not written to the inode table
+static uint32_t inode_unused_cnt;
+static struct lock inode_cache_lock;
+static struct lock inode_flush_lock; // serialises inode_flush_all()
+
+// Background prefetch of inode_prefetch() ranges
+static struct list inode_prefetch_queue;
+static struct lock inode_prefetch_lock;
+static struct condition inode_prefetch_queued;
+static bool inode_prefetch_stop;
+static struct semaphore inode_prefetch_done;
+
+// Blocks freed by one inode_release_range() pass
+struct inode_release {
+	struct freemap_extent extents[INODE_RELEASE_BATCH];
+	int cnt;
+	uint32_t released;	// blocks freed so far, indirect ones included
+};
+
+// Blocks of one inode written by inode_sync()
+struct inode_blocks {
+	struct freemap_extent *extents;	// runs of blocks, sorted before use
+	size_t cnt;
+	size_t max;
+	bool failed;	// out of memory, every block is selected
+};
 
 enum RANGE {
 	RANGE_OVERLAP = 1,
@@ -28,13 +137,42 @@ enum RANGE {
 	RANGE_BEHIND = 1<<4,
 };
 
+static void inode_locate(struct block *b, uint32_t ino_idx, uint32_t *block_idx, uint32_t *block_offset);
+static void inode_read_table(struct block *b, uint32_t ino_idx, struct inode *inode);
+static void inode_write_table(struct block *b, uint32_t ino_idx, struct inode *inode);
+static struct inode_core *inode_core(struct inode *inode);
+static int inode_compare_flush(const void *a, const void *b);
+static struct list *inode_bucket(struct block *d, uint32_t ino);
+static struct inode_core *inode_lookup(struct block *d, uint32_t ino);
+static void inode_ref(struct inode_core *core);
+static void inode_evict(struct inode_core *core);
+static void inode_delete(struct inode_core *core);
+static void inode_prefetcher(void *aux);
+static void inode_collect_blocks(struct block *d, uint32_t block_id, uint32_t level, uint32_t items_per_block, struct inode_blocks *set);
+static void inode_add_block(struct inode_blocks *set, uint32_t block_id);
+static bool inode_filter_blocks(uint32_t block_idx, void *aux);
+static int inode_compare_extent(const void *a, const void *b);
 static uint32_t inode_get_data_block (struct block *d, struct inode *inode, uint32_t idx);
-static uint32_t inode_traverse_linklist(struct block *d, uint32_t block_id, uint32_t idx, uint32_t level);
-static int inode_expand_range(uint32_t block_id, uint32_t level, uint32_t start, uint32_t end, uint32_t items_per_block,uint32_t l0, uint32_t l1, uint32_t l2, uint32_t l3);
-static int inode_shrink_range(uint32_t block_id, uint32_t level, uint32_t start, uint32_t end, uint32_t items_per_block,uint32_t l0, uint32_t l1, uint32_t l2, uint32_t l3);
+static off_t inode_transfer(struct block *d, struct inode *inode, const struct block_iovec *iov, size_t iov_cnt, off_t size, off_t offset, bool write, bool direct);
+static void inode_bounce(struct block *d, uint32_t block_id, uint32_t block_size, uint8_t *bounce, struct inode_iov *it, off_t block_ofs, off_t chunk_size, bool write);
+static off_t inode_iov_size(const struct block_iovec *iov, size_t iov_cnt);
+static size_t inode_iov_contig(struct inode_iov *it);
+static void inode_iov_copy(struct inode_iov *it, uint8_t *data, size_t len, bool write);
+static bool inode_range_allocated(struct block *d, struct inode *inode, uint32_t first, uint32_t last);
+static void inode_range_lock(struct inode *inode, struct inode_range *range);
+static void inode_range_unlock(struct inode *inode, struct inode_range *range);
+static int inode_fill_range(struct block *d, uint32_t ino, struct inode *inode, uint32_t first, uint32_t last, bool zero, uint32_t *allocated);
+static int inode_expand_range(uint32_t block_id, uint32_t level, uint32_t start, uint32_t end, uint32_t items_per_block,uint32_t l0, uint32_t l1, uint32_t l2, uint32_t l3, struct inode_alloc *ctx);
+static uint32_t inode_alloc_block(struct inode_alloc *ctx, bool indirect);
+static void inode_alloc_finish(struct inode_alloc *ctx);
+static void inode_zero_blocks(struct block *d, uint32_t block_idx, uint32_t count, uint32_t block_size);
+static uint32_t inode_release_range(struct block *d, struct inode *inode, uint32_t first, uint32_t last);
+static void inode_release_block(struct inode_release *ctx, uint32_t block_id);
+static int inode_shrink_range(uint32_t block_id, uint32_t level, uint32_t start, uint32_t end, uint32_t items_per_block,uint32_t l0, uint32_t l1, uint32_t l2, uint32_t l3, struct inode_release *ctx);
 static enum RANGE inode_range_compare(uint32_t start1, uint32_t end1, uint32_t start2, uint32_t end2);
 static uint32_t inode_get_direct_block_idx(uint32_t items_per_block, uint32_t l0, uint32_t l1, uint32_t l2, uint32_t l3);
 static int inode_get_indirect_blocks(uint32_t direct_blocks, uint32_t items_per_block);
+static uint64_t inode_max_blocks(uint32_t items_per_block);
 
 void print_inode(struct inode *ino){
 	int i;
@@ -48,60 +186,374 @@ void print_inode(struct inode *ino){
 	printf("\n");
 }
 
-/* Get the ENTRY item of the inode table from BLOCK_GROUP */
-struct inode *ext2_get_inode(struct block *b, uint32_t ino_idx){
-	struct ext2_meta_data *meta = NULL;
-	struct bg_desc_table *bg_desc_tabs = NULL;
-	uint32_t block_size = 0;
-	uint32_t inode_table = 0, inodes_per_group = 0, inodes_per_block = 0;
-	uint32_t block_group = 0, block_idx = 0, block_offset = 0;
-	struct inode *inode_tab = NULL, *inode = NULL;
+/* Initialise the in-core inode cache */
+void inode_cache_init(void){
+	int i;
 
-	//get meta data
-	ASSERT(b != NULL);
-	meta = ext2_get_meta(b);
-	ASSERT(meta != NULL);
-	bg_desc_tabs = meta->bg_desc_tabs;
-	ASSERT(bg_desc_tabs != NULL);
-	ASSERT(block_group < DIV_ROUND_UP(meta->sb->s_blocks_count,
-		meta->sb->s_blocks_per_group));
-	inodes_per_group = meta->sb->s_inodes_per_group;
-	block_size = ext2_get_block_size(meta->sb);
+	lock_init(&inode_cache_lock);
+	lock_init(&inode_flush_lock);
+	for(i = 0; i < INODE_CACHE_BUCKETS; i++) list_init(&inode_buckets[i]);
+	list_init(&inode_unused);
+	list_init(&inode_dirty);
+	inode_unused_cnt = 0;
+
+	// Start background prefetcher
+	list_init(&inode_prefetch_queue);
+	lock_init(&inode_prefetch_lock);
+	cond_init(&inode_prefetch_queued);
+	inode_prefetch_stop = false;
+	sema_init(&inode_prefetch_done,0);
+	if(thread_create("ext2-prefetch",PRI_DEFAULT,inode_prefetcher,NULL) == TID_ERROR)
+		PANIC("Inode cache: cannot create prefetch thread.");
+}
+/* Write back and release every cached inode, none may be in use */
+void inode_cache_free(void){
+	struct inode_core *core;
+
+	// Stop prefetcher, it returns the inodes still queued
+	lock_acquire(&inode_prefetch_lock);
+	inode_prefetch_stop = true;
+	cond_signal(&inode_prefetch_queued,&inode_prefetch_lock);
+	lock_release(&inode_prefetch_lock);
+	sema_down(&inode_prefetch_done);
+
+	inode_flush_all();
+	lock_acquire(&inode_cache_lock);
+	while(!list_empty(&inode_unused)){
+		core = list_entry(list_front(&inode_unused),struct inode_core,lru_elem);
+		inode_evict(core);
+	}
+	lock_release(&inode_cache_lock);
+}
 
-	// get block group
-	ino_idx = ino_idx - 1; // inode index starts from 1 !!!
-	block_group = ino_idx / inodes_per_group;
-	bg_desc_tabs = &bg_desc_tabs[block_group];
+/* Get inode INO_IDX of device B.
+ * All users of one inode share the same in-core copy, it stays valid
+ * until it is returned with ext2_put_inode().
+*/
+struct inode *ext2_get_inode(struct block *b, uint32_t ino_idx){
+	struct inode_core *core, *found;
 
-	// get inode table
-	inode_table = bg_desc_tabs->bg_inode_table;
-	inodes_per_block = block_size/sizeof(struct inode);
-	ASSERT((block_size % sizeof(struct inode)) == 0);
+	ASSERT(b != NULL && ino_idx > 0);
 
-	// calculate inode index in local table
-	ino_idx -= block_group * inodes_per_group;
-	
-	// get block location of inode
-	block_idx = inode_table + ino_idx/inodes_per_block;
-	block_offset = ino_idx % inodes_per_block;
+	lock_acquire(&inode_cache_lock);
+	core = inode_lookup(b,ino_idx);
+	if(core != NULL){
+		inode_ref(core);
+		lock_release(&inode_cache_lock);
+		return &core->data;
+	}
+	lock_release(&inode_cache_lock);
+
+	// Read outside of the cache lock
+	core = kmalloc(sizeof(struct inode_core));
+	if(core == NULL) return NULL;
+	core->device = b;
+	core->ino = ino_idx;
+	core->open_cnt = 0;
+	core->dirty = false;
+	core->unlinked = false;
+	core->synced_size = 0;
+	memset(core->synced_block,0,sizeof(core->synced_block));
+	lock_init(&core->lock);
+	cond_init(&core->unlocked);
+	core->readers = 0;
+	core->writers_waiting = 0;
+	core->writer = false;
+	list_init(&core->ranges);
+	inode_read_table(b,ino_idx,&core->data);
+
+	lock_acquire(&inode_cache_lock);
+	// Another thread may have read it meanwhile
+	found = inode_lookup(b,ino_idx);
+	if(found != NULL){
+		kfree(core);
+		core = found;
+		inode_ref(core);
+	}
+	else{
+		core->open_cnt = 1;
+		list_push_front(inode_bucket(b,ino_idx),&core->elem);
+	}
+	lock_release(&inode_cache_lock);
 
-	// read block data
-	inode_tab = ext2_read_block(b,block_idx,block_size,NULL);
-	inode = kmalloc(sizeof(struct inode));
-	memcpy(inode, &inode_tab[block_offset], sizeof(struct inode));
-	kfree(inode_tab);
+	return &core->data;
+}
+/* Get another reference to a cached INODE */
+struct inode *inode_reopen(struct inode *inode){
+	struct inode_core *core = inode_core(inode);
+
+	lock_acquire(&inode_cache_lock);
+	ASSERT(core->open_cnt > 0);
+	core->open_cnt++;
+	lock_release(&inode_cache_lock);
 
 	return inode;
 }
+/* Return a reference to INODE. Unused inodes stay cached,
+ * the least recently used ones are written back and freed.
+ * An unlinked inode is deleted with its last reference.
+*/
+void ext2_put_inode(struct block *b UNUSED, struct inode *inode){
+	struct inode_core *core;
+
+	if(inode == NULL) return;
+	core = inode_core(inode);
+
+	lock_acquire(&inode_cache_lock);
+	ASSERT(core->open_cnt > 0);
+	if(--core->open_cnt == 0 && core->unlinked){
+		// No entry leads to it, nobody may look it up again
+		list_remove(&core->elem);
+		if(core->dirty){
+			core->dirty = false;
+			list_remove(&core->dirty_elem);
+		}
+		lock_release(&inode_cache_lock);
+		inode_delete(core);
+		return;
+	}
+	if(core->open_cnt == 0){
+		list_push_back(&inode_unused,&core->lru_elem);
+		inode_unused_cnt++;
+		if(inode_unused_cnt > INODE_CACHE_UNUSED)
+			inode_evict(list_entry(list_front(&inode_unused),struct inode_core,lru_elem));
+	}
+	lock_release(&inode_cache_lock);
+}
+/* Drop the last link of a cached INODE, its directory entry is gone.
+ * Users still holding it go on reading and writing it, its blocks and
+ * inode number are freed when the last one returns it.
+*/
+void inode_unlink(struct inode *inode){
+	struct inode_core *core = inode_core(inode);
+
+	inode_lock(inode);
+	inode->i_links_count = 0;
+	inode_mark_dirty(inode);
+	inode_unlock(inode);
+
+	lock_acquire(&inode_cache_lock);
+	core->unlinked = true;
+	lock_release(&inode_cache_lock);
+}
+/* Get the inode number of a cached INODE */
+uint32_t inode_get_inumber(struct inode *inode){
+	return inode_core(inode)->ino;
+}
+/* Serialise changes to a cached INODE, excluding readers */
+void inode_lock(struct inode *inode){
+	struct inode_core *core = inode_core(inode);
+
+	lock_acquire(&core->lock);
+	core->writers_waiting++;
+	while(core->writer || core->readers > 0)
+		cond_wait(&core->unlocked,&core->lock);
+	core->writers_waiting--;
+	core->writer = true;
+	lock_release(&core->lock);
+}
+void inode_unlock(struct inode *inode){
+	struct inode_core *core = inode_core(inode);
+
+	lock_acquire(&core->lock);
+	ASSERT(core->writer);
+	core->writer = false;
+	cond_broadcast(&core->unlocked,&core->lock);
+	lock_release(&core->lock);
+}
+/* Read a cached INODE and its data along with other readers */
+void inode_lock_shared(struct inode *inode){
+	struct inode_core *core = inode_core(inode);
+
+	lock_acquire(&core->lock);
+	while(core->writer || core->writers_waiting > 0)
+		cond_wait(&core->unlocked,&core->lock);
+	core->readers++;
+	lock_release(&core->lock);
+}
+void inode_unlock_shared(struct inode *inode){
+	struct inode_core *core = inode_core(inode);
+
+	lock_acquire(&core->lock);
+	ASSERT(core->readers > 0);
+	if(--core->readers == 0)
+		cond_broadcast(&core->unlocked,&core->lock);
+	lock_release(&core->lock);
+}
+/* In-core INODE has changes not in the inode table yet.
+ * They are written by inode_flush() or inode_flush_all().
+*/
+void inode_mark_dirty(struct inode *inode){
+	struct inode_core *core = inode_core(inode);
+
+	lock_acquire(&inode_cache_lock);
+	if(!core->dirty){
+		core->dirty = true;
+		list_push_back(&inode_dirty,&core->dirty_elem);
+	}
+	lock_release(&inode_cache_lock);
+}
+/* Write INODE to the inode table if it is dirty */
+void inode_flush(struct block *b, struct inode *inode){
+	struct inode_core *core = inode_core(inode);
+
+	// Clear before writing, changes made meanwhile mark it again
+	lock_acquire(&inode_cache_lock);
+	if(!core->dirty){
+		lock_release(&inode_cache_lock);
+		return;
+	}
+	core->dirty = false;
+	list_remove(&core->dirty_elem);
+	lock_release(&inode_cache_lock);
+
+	inode_lock_shared(inode);
+	inode_write_table(b,core->ino,inode);
+	inode_unlock_shared(inode);
+}
+/* Write all dirty inodes to the inode table. Inodes sharing
+ * an inode table block are copied into it in one go.
+*/
+void inode_flush_all(void){
+	struct inode_flush *batch;
+	struct cache_block *b_tab = NULL;
+	struct inode_core *core;
+	uint32_t cnt = 0, i;
+
+	/* A flush returning early while another one is still copying
+	 * would let a sync write the inode table too soon. */
+	lock_acquire(&inode_flush_lock);
+
+	// Take the dirty list, holding a reference to each inode
+	lock_acquire(&inode_cache_lock);
+	if(list_empty(&inode_dirty)){
+		lock_release(&inode_cache_lock);
+		lock_release(&inode_flush_lock);
+		return;
+	}
+	batch = kmalloc(list_size(&inode_dirty) * sizeof(struct inode_flush));
+	if(batch == NULL){
+		lock_release(&inode_cache_lock);
+		lock_release(&inode_flush_lock);
+		return;
+	}
+	while(!list_empty(&inode_dirty)){
+		core = list_entry(list_pop_front(&inode_dirty),struct inode_core,dirty_elem);
+		core->dirty = false;
+		inode_ref(core);
+		batch[cnt++].core = core;
+	}
+	lock_release(&inode_cache_lock);
+
+	// Order by inode table block
+	for(i = 0; i < cnt; i++)
+		inode_locate(batch[i].core->device,batch[i].core->ino,&batch[i].block_idx,&batch[i].block_offset);
+	qsort(batch,cnt,sizeof(struct inode_flush),inode_compare_flush);
+
+	for(i = 0; i < cnt; i++){
+		core = batch[i].core;
+		// Borrow each inode table block once
+		if(b_tab == NULL || batch[i-1].core->device != core->device
+			|| batch[i-1].block_idx != batch[i].block_idx){
+			if(b_tab != NULL){
+				cache_mark_dirty(b_tab);
+				cache_put(b_tab);
+			}
+			b_tab = cache_get(core->device,batch[i].block_idx,true);
+		}
+		inode_lock_shared(&core->data);
+		memcpy((struct inode*)cache_data(b_tab) + batch[i].block_offset, &core->data, sizeof(struct inode));
+		inode_unlock_shared(&core->data);
+	}
+	if(b_tab != NULL){
+		cache_mark_dirty(b_tab);
+		cache_put(b_tab);
+	}
+
+	for(i = 0; i < cnt; i++)
+		ext2_put_inode(batch[i].core->device,&batch[i].core->data);
+	kfree(batch);
+	lock_release(&inode_flush_lock);
+}
+/* Write the dirty data and indirect blocks of INODE to device D, then
+ * its inode table entry. Other dirty blocks of D are left alone.
+ * With DATASYNC set the inode is only written if its size or block map
+ * changed since the last sync, like fdatasync(). The inode lock is held
+ * shared while the blocks are collected, not during the write back.
+*/
+void inode_sync(struct block *d, struct inode *inode, bool datasync){
+	struct inode_core *core = inode_core(inode);
+	struct ext2_meta_data *meta;
+	struct inode_blocks set = {NULL, 0, 0, false};
+	uint32_t items_per_block, block_idx, block_offset, i;
+	bool write_inode;
+
+	ASSERT(d != NULL && inode != NULL);
+
+	meta = ext2_get_meta(d);
+	ASSERT(meta != NULL && meta->sb != NULL);
+	items_per_block = ext2_get_block_size(meta->sb) / sizeof(uint32_t);
+
+	// Writers wait while the block list is collected
+	inode_lock_shared(inode);
+	for(i = 0; i < DIRECT_BLOCKS; i++)
+		inode_collect_blocks(d,inode->i_block[i],0,items_per_block,&set);
+	for(i = 0; i < 3; i++)
+		inode_collect_blocks(d,inode->i_block[DIRECT_BLOCKS+i],i+1,items_per_block,&set);
+
+	// Concurrent syncs update the synced copy under the core lock
+	lock_acquire(&core->lock);
+	write_inode = !datasync || core->synced_size != inode->i_size
+		|| memcmp(core->synced_block,inode->i_block,sizeof(core->synced_block)) != 0;
+	if(write_inode){
+		core->synced_size = inode->i_size;
+		memcpy(core->synced_block,inode->i_block,sizeof(core->synced_block));
+	}
+	lock_release(&core->lock);
+	if(write_inode){
+		ext2_write_inode(d,core->ino,inode);
+		inode_locate(d,core->ino,&block_idx,&block_offset);
+		inode_add_block(&set,block_idx);
+	}
+	inode_unlock_shared(inode);
+
+	// Write back without the inode lock, readers and writers go on
+	if(!set.failed)
+		qsort(set.extents,set.cnt,sizeof(struct freemap_extent),inode_compare_extent);
+	cache_flush_blocks(d,inode_filter_blocks,&set);
 
-/* Write ENTRY item of the inode table from BLOCK_GROUP */
+	if(set.extents != NULL) kfree(set.extents);
+}
+/* Write INODE to entry INO_IDX of the inode table.
+ * INODE may be a cached inode or a copy, the cached inode is kept
+ * up to date either way.
+*/
 void ext2_write_inode(struct block *b, uint32_t ino_idx, struct inode *inode){
+	struct inode_core *core;
+
+	ASSERT(b != NULL && inode != NULL);
+
+	lock_acquire(&inode_cache_lock);
+	core = inode_lookup(b,ino_idx);
+	if(core != NULL){
+		if(&core->data != inode) memcpy(&core->data,inode,sizeof(struct inode));
+		if(core->dirty){
+			core->dirty = false;
+			list_remove(&core->dirty_elem);
+		}
+	}
+	lock_release(&inode_cache_lock);
+
+	inode_write_table(b,ino_idx,inode);
+}
+
+/* Locate entry INO_IDX of the inode table: its block and index in it */
+static void inode_locate(struct block *b, uint32_t ino_idx, uint32_t *block_idx, uint32_t *block_offset){
 	struct ext2_meta_data *meta = NULL;
 	struct bg_desc_table *bg_desc_tabs = NULL;
 	uint32_t block_size = 0;
 	uint32_t inode_table = 0, inodes_per_group = 0, inodes_per_block = 0;
-	uint32_t block_group = 0, block_idx = 0, block_offset = 0;
-	struct inode *inode_tab = NULL;
+	uint32_t block_group = 0;
 
 	//get meta data
 	ASSERT(b != NULL);
@@ -109,14 +561,14 @@ void ext2_write_inode(struct block *b, uint32_t ino_idx, struct inode *inode){
 	ASSERT(meta != NULL);
 	bg_desc_tabs = meta->bg_desc_tabs;
 	ASSERT(bg_desc_tabs != NULL);
-	ASSERT(block_group < DIV_ROUND_UP(meta->sb->s_blocks_count,
-		meta->sb->s_blocks_per_group));
 	inodes_per_group = meta->sb->s_inodes_per_group;
 	block_size = ext2_get_block_size(meta->sb);
 
 	// get block group
 	ino_idx = ino_idx - 1; // inode index starts from 1 !!!
 	block_group = ino_idx / inodes_per_group;
+	ASSERT(block_group < DIV_ROUND_UP(meta->sb->s_blocks_count,
+		meta->sb->s_blocks_per_group));
 	bg_desc_tabs = &bg_desc_tabs[block_group];
 
 	// get inode table
@@ -128,137 +580,603 @@ void ext2_write_inode(struct block *b, uint32_t ino_idx, struct inode *inode){
 	ino_idx -= block_group * inodes_per_group;
 	
 	// get block location of inode
-	block_idx = inode_table + ino_idx/inodes_per_block;
-	block_offset = ino_idx % inodes_per_block;
+	*block_idx = inode_table + ino_idx/inodes_per_block;
+	*block_offset = ino_idx % inodes_per_block;
+}
+/* Copy entry INO_IDX of the inode table to INODE */
+static void inode_read_table(struct block *b, uint32_t ino_idx, struct inode *inode){
+	uint32_t block_idx, block_offset;
+	struct cache_block *b_tab;
+
+	inode_locate(b,ino_idx,&block_idx,&block_offset);
 
 	// read block data
-	inode_tab = ext2_read_block(b,block_idx,block_size,NULL);
+	b_tab = cache_get(b,block_idx,true);
+	memcpy(inode, (struct inode*)cache_data(b_tab) + block_offset, sizeof(struct inode));
+	cache_put(b_tab);
+}
+/* Copy INODE to entry INO_IDX of the inode table */
+static void inode_write_table(struct block *b, uint32_t ino_idx, struct inode *inode){
+	uint32_t block_idx, block_offset;
+	struct cache_block *b_tab;
+
+	inode_locate(b,ino_idx,&block_idx,&block_offset);
+
+	// read block data
+	b_tab = cache_get(b,block_idx,true);
 	// modify corresponding entry
-	memcpy(&inode_tab[block_offset], inode, sizeof(struct inode));
+	memcpy((struct inode*)cache_data(b_tab) + block_offset, inode, sizeof(struct inode));
 	// write to disk
-	ext2_write_block(b,block_idx,block_size,inode_tab);
+	cache_mark_dirty(b_tab);
+
+	// release buffer
+	cache_put(b_tab);
+}
+/* Get the cache entry holding INODE */
+static struct inode_core *inode_core(struct inode *inode){
+	ASSERT(inode != NULL);
+	return (struct inode_core*)((uint8_t*)inode - offsetof(struct inode_core,data));
+}
+/* Order inodes to flush by inode table location */
+static int inode_compare_flush(const void *a, const void *b){
+	const struct inode_flush *x = a, *y = b;
+
+	if(x->core->device != y->core->device) return (uintptr_t)x->core->device < (uintptr_t)y->core->device ? -1 : 1;
+	if(x->block_idx != y->block_idx) return x->block_idx < y->block_idx ? -1 : 1;
+	return x->block_offset < y->block_offset ? -1 : x->block_offset > y->block_offset;
+}
+/* Add block BLOCK_ID and, for LEVEL > 0, the blocks of the indirect
+ * tree it roots to SET.
+*/
+static void inode_collect_blocks(struct block *d, uint32_t block_id, uint32_t level, uint32_t items_per_block, struct inode_blocks *set){
+	struct cache_block *b;
+	uint32_t *table, i;
+
+	if(block_id == 0) return;
+	inode_add_block(set,block_id);
+	if(level == 0 || set->failed) return;
+
+	b = cache_get(d,block_id,true);
+	table = cache_data(b);
+	for(i = 0; i < items_per_block; i++)
+		inode_collect_blocks(d,table[i],level-1,items_per_block,set);
+	cache_put(b);
+}
+/* Add BLOCK_ID to SET, extending the last run if it follows it */
+static void inode_add_block(struct inode_blocks *set, uint32_t block_id){
+	struct freemap_extent *extents;
+
+	if(set->failed) return;
+	if(set->cnt > 0 && set->extents[set->cnt-1].start + set->extents[set->cnt-1].count == block_id){
+		set->extents[set->cnt-1].count++;
+		return;
+	}
+	if(set->cnt == set->max){
+		// Grow the run array
+		extents = kmalloc((set->max ? set->max * 2 : INODE_MAP_BATCH) * sizeof(struct freemap_extent));
+		if(extents == NULL){
+			set->failed = true;
+			return;
+		}
+		if(set->extents != NULL){
+			memcpy(extents,set->extents,set->cnt * sizeof(struct freemap_extent));
+			kfree(set->extents);
+		}
+		set->extents = extents;
+		set->max = set->max ? set->max * 2 : INODE_MAP_BATCH;
+	}
+	set->extents[set->cnt].start = block_id;
+	set->extents[set->cnt].count = 1;
+	set->cnt++;
+}
+/* Cache filter selecting the blocks of an inode_blocks set */
+static bool inode_filter_blocks(uint32_t block_idx, void *aux){
+	const struct inode_blocks *set = aux;
+	size_t lo = 0, hi = set->cnt, mid;
+
+	if(set->failed) return true;
+	// Runs are sorted by start and do not overlap
+	while(lo < hi){
+		mid = lo + (hi - lo) / 2;
+		if(block_idx < set->extents[mid].start) hi = mid;
+		else if(block_idx - set->extents[mid].start >= set->extents[mid].count) lo = mid + 1;
+		else return true;
+	}
+	return false;
+}
+static int inode_compare_extent(const void *a, const void *b){
+	const struct freemap_extent *x = a, *y = b;
+
+	if(x->start != y->start) return x->start < y->start ? -1 : 1;
+	return 0;
+}
+/* Get hash bucket of inode INO on device D */
+static struct list *inode_bucket(struct block *d, uint32_t ino){
+	uint32_t hash = (uint32_t)(uintptr_t)d ^ (ino * 2654435761u);
+	return &inode_buckets[hash % INODE_CACHE_BUCKETS];
+}
+/* Find cached inode INO of device D, cache lock must be held */
+static struct inode_core *inode_lookup(struct block *d, uint32_t ino){
+	struct list *bucket = inode_bucket(d,ino);
+	struct list_elem *e;
+	struct inode_core *core;
 
-	// release memory
-	kfree(inode_tab);
+	ASSERT(lock_held_by_current_thread(&inode_cache_lock));
+
+	for(e = list_begin(bucket); e != list_end(bucket); e = list_next(e)){
+		core = list_entry(e,struct inode_core,elem);
+		if(core->device == d && core->ino == ino) return core;
+	}
+	return NULL;
+}
+/* Take a reference to CORE, cache lock must be held */
+static void inode_ref(struct inode_core *core){
+	ASSERT(lock_held_by_current_thread(&inode_cache_lock));
+
+	if(core->open_cnt++ == 0){
+		// Inode was unused, take it off the LRU list
+		list_remove(&core->lru_elem);
+		inode_unused_cnt--;
+	}
+}
+/* Write back and free unused inode CORE, cache lock must be held */
+static void inode_evict(struct inode_core *core){
+	ASSERT(lock_held_by_current_thread(&inode_cache_lock));
+	ASSERT(core->open_cnt == 0);
+
+	list_remove(&core->lru_elem);
+	inode_unused_cnt--;
+	list_remove(&core->elem);
+	if(core->dirty){
+		list_remove(&core->dirty_elem);
+		inode_write_table(core->device,core->ino,&core->data);
+	}
+	kfree(core);
+}
+/* Free the blocks and the inode number of unlinked inode CORE, no
+ * longer referenced nor cached, then CORE itself.
+*/
+static void inode_delete(struct inode_core *core){
+	ASSERT(core->open_cnt == 0 && core->unlinked);
+
+	// Truncate file to zero length, aka. free blocks
+	inode_resize(core->ino,&core->data,0);
+
+	// Zero inode, then free it
+	memset(&core->data,0,sizeof(struct inode));
+	inode_write_table(core->device,core->ino,&core->data);
+	freemap_free_inode(core->ino);
+	kfree(core);
 }
 /* inode read from given position */
 off_t inode_read_at(struct block *d, struct inode *inode, void *buffer_, off_t size, off_t offset){
+	struct block_iovec iov = {buffer_, size};
+
+	if(size <= 0) return 0;
+	return inode_readv_at(d,inode,&iov,1,offset,false);
+}
+/* Read from OFFSET into the IOV_CNT buffers of IOV, filled in order.
+ * DIRECT reads do not add data blocks to the buffer cache.
+*/
+off_t inode_readv_at(struct block *d, struct inode *inode, const struct block_iovec *iov, size_t iov_cnt, off_t offset, bool direct){
+	off_t size;
+
+	ASSERT(d != NULL && inode != NULL);
+	size = inode_iov_size(iov,iov_cnt);
+
+	// no bytes to be read
+	if(offset >= (off_t)inode->i_size) return 0;
+	if(size > (off_t)inode->i_size - offset) size = inode->i_size - offset;
+
+	return inode_transfer(d,inode,iov,iov_cnt,size,offset,false,direct);
+}
+
+/* Initialise readahead state RA of a newly opened file */
+void inode_readahead_init(struct inode_readahead *ra){
+	lock_init(&ra->lock);
+	ra->mode = INODE_RA_NORMAL;
+	ra->next = 0;
+	ra->start = 0;
+	ra->size = 0;
+}
+/* Detect sequential reads of SIZE bytes at OFFSET and prefetch the
+ * upcoming data blocks, and the indirect blocks mapping them, into the
+ * buffer cache. The window starts at INODE_RA_MIN_WINDOW and doubles every
+ * time the reader reaches its second half, up to INODE_RA_MAX_WINDOW.
+ * A non-sequential read collapses the window. In INODE_RA_SEQUENTIAL mode
+ * windows start at the largest size, in INODE_RA_RANDOM mode nothing is
+ * read ahead. The caller holds the inode lock, shared is enough.
+*/
+void inode_readahead(struct block *d, struct inode *inode, struct inode_readahead *ra, off_t offset, off_t size){
+	off_t start, end;
+
+	ASSERT(d != NULL && inode != NULL && ra != NULL);
+
+	lock_acquire(&ra->lock);
+	// Random access, collapse window
+	if(offset != ra->next || ra->mode == INODE_RA_RANDOM){
+		ra->next = offset + size;
+		ra->size = 0;
+		lock_release(&ra->lock);
+		return;
+	}
+	ra->next = offset + size;
+
+	// Start a window after the current read, or move to the next window
+	// once the reader is in the second half of the current one
+	if(ra->size == 0 || offset + size > ra->start + ra->size){
+		ra->start = offset + size;
+		ra->size = INODE_RA_MIN_WINDOW;
+		// Known sequential reader, start as large as growing would get
+		if(ra->mode == INODE_RA_SEQUENTIAL)
+			while(ra->size < INODE_RA_MAX_WINDOW && ra->size < CACHE_BUDGET / 4) ra->size *= 2;
+	}
+	else if(offset + size > ra->start + ra->size / 2){
+		ra->start += ra->size;
+		// Window never takes more than a quarter of the cache
+		if(ra->size < INODE_RA_MAX_WINDOW && ra->size < CACHE_BUDGET / 4) ra->size *= 2;
+	}
+	else{
+		lock_release(&ra->lock);
+		return;
+	}
+	start = ra->start;
+	end = ra->start + ra->size;
+	lock_release(&ra->lock);
+
+	// Prefetch the window extent by extent
+	inode_cache_range(d,inode,start,end - start,INODE_CACHE_PREFETCH);
+}
+/* Apply OP to the cached data blocks of LEN bytes of INODE at OFFSET,
+ * clipped to the file. Mapping the range reads the indirect blocks
+ * leading to it into the cache. The caller holds the inode lock, shared
+ * is enough.
+*/
+void inode_cache_range(struct block *d, struct inode *inode, off_t offset, off_t len, enum INODE_CACHE_OP op){
 	struct ext2_meta_data *meta;
-	uint32_t block_size,block_id,block_idx,block_ofs;
-	uint8_t *buffer = buffer_, *bounce = NULL;
-	off_t bytes_read = 0;
+	struct inode_extent extents[INODE_MAP_BATCH];
+	uint32_t block_size, first, last;
+	off_t end;
+	int i, cnt;
 
 	ASSERT(d != NULL && inode != NULL);
 
+	// Clip range to the file
+	if(offset < 0 || len <= 0 || offset >= (off_t)inode->i_size) return;
+	end = len > (off_t)inode->i_size - offset ? (off_t)inode->i_size : offset + len;
+
 	// get device meta data
 	meta = ext2_get_meta(d);
 	ASSERT(meta != NULL && meta->sb != NULL);
 	block_size = ext2_get_block_size(meta->sb);
 
-	// read from disk
-	while(size > 0){
-		// get data block id
-		block_idx = offset / block_size; // the nth data block
-		block_ofs = offset % block_size; // byte offset with data block
-		block_id = inode_get_data_block(d,inode,block_idx); // data block id in fs
-		ASSERT(block_id != UINT32_MAX);
-
-		// Calculate bytes to copy
-		// off_t is signed.
-		off_t inode_left = inode->i_size - offset;
-		off_t block_left = block_size - block_ofs;
-		off_t min_left = inode_left < block_left ? inode_left : block_left;
-		off_t chunk_size = size < min_left ? size : min_left;
-
-		// no bytes to be read
-		if(chunk_size <= 0) break;
-
-		// whole block data
-		if(block_ofs == 0 && chunk_size == block_size)
-			ext2_read_block(d,block_id,block_size,buffer+bytes_read);
-		else{
-			if(bounce == NULL){
-				bounce = kmalloc(block_size);
-				if(bounce == NULL) break;
+	first = offset / block_size;
+	last = (end - 1) / block_size;
+	while(first <= last){
+		cnt = inode_map_range(d,inode,first,last-first+1,extents,INODE_MAP_BATCH);
+		for(i = 0; i < cnt; i++){
+			if(extents[i].physical == 0) continue;
+			switch(op){
+				case INODE_CACHE_PREFETCH:
+					cache_prefetch(d,extents[i].physical,extents[i].length);
+					break;
+				case INODE_CACHE_DEMOTE:
+					cache_demote(d,extents[i].physical,extents[i].length);
+					break;
+				case INODE_CACHE_DROP:
+					cache_drop(d,extents[i].physical,extents[i].length);
+					break;
 			}
-			ext2_read_block(d,block_id,block_size,bounce);
-			memcpy(buffer+bytes_read,bounce+block_ofs,chunk_size);
 		}
-
-		// advance.
-		size -= chunk_size;
-		offset += chunk_size;
-		bytes_read += chunk_size;
+		first = extents[cnt-1].logical + extents[cnt-1].length;
 	}
+}
+/* Read LEN bytes of INODE at OFFSET, and the indirect blocks mapping
+ * them, into the cache in the background. Nothing happens if the request
+ * cannot be queued.
+*/
+void inode_prefetch(struct block *d, struct inode *inode, off_t offset, off_t len){
+	struct inode_prefetch *p;
 
-	if(bounce != NULL) kfree(bounce);
-	return bytes_read;
+	ASSERT(d != NULL && inode != NULL);
+	if(len <= 0) return;
+
+	p = kmalloc(sizeof(struct inode_prefetch));
+	if(p == NULL) return;
+	p->device = d;
+	p->inode = inode_reopen(inode);
+	p->offset = offset;
+	p->len = len;
+
+	lock_acquire(&inode_prefetch_lock);
+	list_push_back(&inode_prefetch_queue,&p->elem);
+	cond_signal(&inode_prefetch_queued,&inode_prefetch_lock);
+	lock_release(&inode_prefetch_lock);
 }
 
-/* inode read from given position */
-off_t inode_write_at(struct block *d, struct inode *inode, const void *buffer_, off_t size, off_t offset){
+/* inode write from given position */
+off_t inode_write_at(struct block *d, uint32_t ino, struct inode *inode, const void *buffer_, off_t size, off_t offset){
+	struct block_iovec iov = {(void*)buffer_, size};
+
+	if(size <= 0) return 0;
+	return inode_writev_at(d,ino,inode,&iov,1,offset,false);
+}
+/* Write the IOV_CNT buffers of IOV, in order, from OFFSET.
+ * The whole span is one write: the file is resized, the block map walked
+ * and the inode marked dirty once. INODE is locked here.
+ * DIRECT writes do not add data blocks to the buffer cache.
+ * Writes inside the allocated part of the file hold the inode lock shared
+ * and lock only the blocks they cover, writes to disjoint blocks run in
+ * parallel. Writes extending the file or filling holes hold it exclusively.
+*/
+off_t inode_writev_at(struct block *d, uint32_t ino, struct inode *inode, const struct block_iovec *iov, size_t iov_cnt, off_t offset, bool direct){
 	struct ext2_meta_data *meta;
-	uint32_t block_size,block_id,block_idx,block_ofs;
-	const uint8_t *buffer = buffer_;
-	uint8_t *bounce = NULL;
-	off_t bytes_written = 0, err;
+	struct inode_range range;
+	uint32_t block_size, allocated = 0, end_block, old_blocks;
+	off_t size, bytes_written;
+	int err;
 
 	ASSERT(d != NULL && inode != NULL);
+	size = inode_iov_size(iov,iov_cnt);
+	if(size <= 0) return 0;
 
-	// Resize inode
-	err = inode_resize(inode,offset + size);
-	if(err < 0) {
+	// get device meta data
+	meta = ext2_get_meta(d);
+	ASSERT(meta != NULL && meta->sb != NULL);
+	block_size = ext2_get_block_size(meta->sb);
+	range.first = offset / block_size;
+	range.last = (offset + size - 1) / block_size;
+
+	// In place, size and block map stay as they are
+	inode_lock_shared(inode);
+	if((uint32_t)(offset + size) <= inode->i_size
+		&& inode_range_allocated(d,inode,range.first,range.last)){
+		inode_range_lock(inode,&range);
+		bytes_written = inode_transfer(d,inode,iov,iov_cnt,size,offset,true,direct);
+		inode_range_unlock(inode,&range);
+		inode_unlock_shared(inode);
+		return bytes_written;
+	}
+	inode_unlock_shared(inode);
+
+	inode_lock(inode);
+	old_blocks = inode->i_blocks;
+	// Fill holes inside the file, new blocks read as zeros
+	end_block = DIV_ROUND_UP(inode->i_size,block_size);
+	if(range.first < end_block){
+		if(range.last >= end_block) range.last = end_block - 1;
+		err = inode_fill_range(d,ino,inode,range.first,range.last,true,&allocated);
+		// Important: i_blocks are number of 512 byte sectors, not fs blocks !!
+		inode->i_blocks += allocated*(2<<meta->sb->s_log_block_size);
+		if(err < 0) goto fail;
+	}
+	// Expand inode, writes never shrink the file
+	if((uint32_t)(offset + size) > inode->i_size && inode_resize(ino,inode,offset + size) < 0){
 		printf("inode_write_at: resize failed.\n");
-		return 0;
+		goto fail;
 	}
+	bytes_written = inode_transfer(d,inode,iov,iov_cnt,size,offset,true,direct);
+
+	// Inode is written back lazily
+	inode_mark_dirty(inode);
+	inode_unlock(inode);
+	return bytes_written;
+
+fail:
+	// Blocks allocated before the failure stay in the block map
+	if(inode->i_blocks != old_blocks) inode_mark_dirty(inode);
+	inode_unlock(inode);
+	return 0;
+}
+/* Whether data blocks FIRST to LAST of INODE are all allocated */
+static bool inode_range_allocated(struct block *d, struct inode *inode, uint32_t first, uint32_t last){
+	struct inode_extent extents[INODE_MAP_BATCH];
+	int i, cnt;
+
+	while(first <= last){
+		cnt = inode_map_range(d,inode,first,last-first+1,extents,INODE_MAP_BATCH);
+		for(i = 0; i < cnt; i++)
+			if(extents[i].physical == 0) return false;
+		first = extents[cnt-1].logical + extents[cnt-1].length;
+	}
+	return true;
+}
+/* Wait until no other in-place write holds a block of RANGE, then
+ * hold them. The inode lock is held shared.
+*/
+static void inode_range_lock(struct inode *inode, struct inode_range *range){
+	struct inode_core *core = inode_core(inode);
+	struct inode_range *held;
+	struct list_elem *e;
+
+	lock_acquire(&core->lock);
+	e = list_begin(&core->ranges);
+	while(e != list_end(&core->ranges)){
+		held = list_entry(e,struct inode_range,elem);
+		// Overlapping range, wait and look again
+		if((inode_range_compare(range->first,range->last,held->first,held->last) & RANGE_OVERLAP) > 0){
+			cond_wait(&core->unlocked,&core->lock);
+			e = list_begin(&core->ranges);
+		}
+		else e = list_next(e);
+	}
+	list_push_back(&core->ranges,&range->elem);
+	lock_release(&core->lock);
+}
+static void inode_range_unlock(struct inode *inode, struct inode_range *range){
+	struct inode_core *core = inode_core(inode);
+
+	lock_acquire(&core->lock);
+	list_remove(&range->elem);
+	cond_broadcast(&core->unlocked,&core->lock);
+	lock_release(&core->lock);
+}
+
+/* Copy SIZE bytes between the buffers of IOV and the inode data at OFFSET.
+ * The block map is resolved in runs with inode_map_range(), partial blocks
+ * and blocks split between buffers go through the buffer cache, whole
+ * blocks inside one buffer are transferred in runs.
+ * With DIRECT partial blocks go through a bounce block instead, so the
+ * transfer adds nothing to the cache.
+*/
+static off_t inode_transfer(struct block *d, struct inode *inode, const struct block_iovec *iov, size_t iov_cnt, off_t size, off_t offset, bool write, bool direct){
+	struct ext2_meta_data *meta;
+	struct inode_extent extents[INODE_MAP_BATCH];
+	struct inode_iov it = {iov, iov_cnt, 0};
+	struct cache_block *b;
+	uint32_t block_size, first, last, block_id, block_idx, run;
+	off_t block_ofs, chunk_size, bytes_done = 0;
+	uint8_t *buffer, *bounce = NULL;
+	int i, cnt;
 
 	// get device meta data
 	meta = ext2_get_meta(d);
 	ASSERT(meta != NULL && meta->sb != NULL);
 	block_size = ext2_get_block_size(meta->sb);
 
-	// read from disk
-	while(size > 0){
-		// get data block id
-		block_idx = offset / block_size; // the nth data block
-		block_ofs = offset % block_size; // byte offset with data block
-		block_id = inode_get_data_block(d,inode,block_idx); // data block id in fs
-		ASSERT(block_id != UINT32_MAX);
-
-		// Calculate bytes to write
-		// off_t is signed.
-		off_t inode_left = inode->i_size - offset;
-		off_t block_left = block_size - block_ofs;
-		off_t min_left = inode_left < block_left ? inode_left : block_left;
-		off_t chunk_size = size < min_left ? size : min_left;
-
-		// no bytes to be read
-		if(chunk_size <= 0) break;
-
-		// whole block data
-		if(block_ofs == 0 && chunk_size == block_size)
-			ext2_write_block(d,block_id,block_size,buffer+bytes_written);
-		else{
-			if(bounce == NULL){
-				bounce = kmalloc(block_size);
-				if(bounce == NULL) break;
+	if(size <= 0) return 0;
+
+	// logical block range
+	first = offset / block_size;
+	last = (offset + size - 1) / block_size;
+
+	// Partial blocks fall back to the cache without a bounce block
+	if(direct) bounce = kmalloc(block_size);
+
+	while(first <= last){
+		cnt = inode_map_range(d,inode,first,last-first+1,extents,INODE_MAP_BATCH);
+		ASSERT(cnt > 0);
+
+		for(i = 0; i < cnt; i++){
+			block_idx = extents[i].logical;
+			block_id = extents[i].physical;
+			run = extents[i].length;
+			// unallocated blocks cannot be written
+			ASSERT(block_id != 0 || !write);
+
+			while(run > 0){
+				block_ofs = offset % block_size;
+				chunk_size = block_size - block_ofs;
+				if(chunk_size > size) chunk_size = size;
+
+				// whole blocks, transfer the rest of the run in the buffer at once
+				if(block_ofs == 0 && chunk_size == block_size && block_id != 0
+					&& inode_iov_contig(&it) >= block_size){
+					uint32_t whole = size / block_size;
+					if(whole > run) whole = run;
+					if(whole > inode_iov_contig(&it) / block_size) whole = inode_iov_contig(&it) / block_size;
+					buffer = (uint8_t*)it.iov->base + it.ofs;
+					if(write) ext2_write_blocks(d,block_id,whole,block_size,buffer);
+					else ext2_read_blocks(d,block_id,whole,block_size,buffer);
+					chunk_size = whole * block_size;
+					it.ofs += chunk_size;
+					block_id += whole;
+					block_idx += whole;
+					run -= whole;
+				}
+				// partial block or block split between buffers, through cache
+				else{
+					if(block_id == 0) inode_iov_copy(&it,NULL,chunk_size,false);
+					else if(bounce != NULL) inode_bounce(d,block_id,block_size,bounce,&it,block_ofs,chunk_size,write);
+					else{
+						b = cache_get(d,block_id,true);
+						inode_iov_copy(&it,(uint8_t*)cache_data(b)+block_ofs,chunk_size,write);
+						if(write) cache_mark_dirty(b);
+						cache_put(b);
+					}
+					if(block_id != 0) block_id++;
+					block_idx++;
+					run--;
+				}
+
+				// advance.
+				size -= chunk_size;
+				offset += chunk_size;
+				bytes_done += chunk_size;
 			}
-			// First read the block from disk
-			ext2_read_block(d,block_id,block_size,bounce);
-			// Modify data read
-			memcpy(bounce+block_ofs,buffer+bytes_written,chunk_size);
-			// Write to disk
-			ext2_write_block(d,block_id,block_size,bounce);
 		}
-
-		// advance.
-		size -= chunk_size;
-		offset += chunk_size;
-		bytes_written += chunk_size;
+		first = extents[cnt-1].logical + extents[cnt-1].length;
 	}
 
 	if(bounce != NULL) kfree(bounce);
-	return bytes_written;
+	return bytes_done;
+}
+/* Copy CHUNK_SIZE bytes at BLOCK_OFS of block BLOCK_ID from or to IT
+ * through BOUNCE, without caching the block. ext2_read_blocks() and
+ * ext2_write_blocks() use the cached copy if there is one, so the cache
+ * stays coherent.
+*/
+static void inode_bounce(struct block *d, uint32_t block_id, uint32_t block_size, uint8_t *bounce, struct inode_iov *it, off_t block_ofs, off_t chunk_size, bool write){
+	// a block written whole needs no read
+	if(!write || chunk_size != (off_t)block_size)
+		ext2_read_blocks(d,block_id,1,block_size,bounce);
+	inode_iov_copy(it,bounce+block_ofs,chunk_size,write);
+	if(write) ext2_write_blocks(d,block_id,1,block_size,bounce);
+}
+/* Total length of the IOV_CNT buffers of IOV */
+static off_t inode_iov_size(const struct block_iovec *iov, size_t iov_cnt){
+	off_t size = 0;
+	size_t i;
+
+	ASSERT(iov != NULL || iov_cnt == 0);
+	for(i = 0; i < iov_cnt; i++) size += iov[i].len;
+	return size;
+}
+/* Bytes left in the current buffer of IT, empty buffers are skipped */
+static size_t inode_iov_contig(struct inode_iov *it){
+	while(it->cnt > 0 && it->ofs == it->iov->len){
+		it->iov++;
+		it->cnt--;
+		it->ofs = 0;
+	}
+	return it->cnt > 0 ? it->iov->len - it->ofs : 0;
+}
+/* Copy LEN bytes between DATA and the buffers of IT and move past them.
+ * WRITE copies from the buffers to DATA, else DATA is copied to the
+ * buffers, or zeros if DATA is NULL.
+*/
+static void inode_iov_copy(struct inode_iov *it, uint8_t *data, size_t len, bool write){
+	size_t n;
+
+	while(len > 0){
+		n = inode_iov_contig(it);
+		ASSERT(n > 0);
+		if(n > len) n = len;
+		if(write) memcpy(data,(uint8_t*)it->iov->base + it->ofs,n);
+		else if(data != NULL) memcpy((uint8_t*)it->iov->base + it->ofs,data,n);
+		else memset((uint8_t*)it->iov->base + it->ofs,0,n);
+		if(data != NULL) data += n;
+		it->ofs += n;
+		len -= n;
+	}
+}
+
+/* Background prefetcher, reads the ranges queued by inode_prefetch().
+ * Once stopped the remaining ranges are dropped.
+*/
+static void inode_prefetcher(void *aux UNUSED){
+	struct inode_prefetch *p;
+
+	lock_acquire(&inode_prefetch_lock);
+	while(true){
+		while(list_empty(&inode_prefetch_queue) && !inode_prefetch_stop)
+			cond_wait(&inode_prefetch_queued,&inode_prefetch_lock);
+		if(list_empty(&inode_prefetch_queue)) break;
+		p = list_entry(list_pop_front(&inode_prefetch_queue),struct inode_prefetch,elem);
+		lock_release(&inode_prefetch_lock);
+
+		if(!inode_prefetch_stop){
+			inode_lock_shared(p->inode);
+			inode_cache_range(p->device,p->inode,p->offset,p->len,INODE_CACHE_PREFETCH);
+			inode_unlock_shared(p->inode);
+		}
+		ext2_put_inode(p->device,p->inode);
+		kfree(p);
+
+		lock_acquire(&inode_prefetch_lock);
+	}
+	lock_release(&inode_prefetch_lock);
+	sema_up(&inode_prefetch_done);
 }
 
 /* Get N th data block of inode */
@@ -286,10 +1204,31 @@ void *inode_get_block_data(struct block *d, struct inode *inode, uint32_t block_
 
 /* Get the actual data block id from idx */
 static uint32_t inode_get_data_block (struct block *d, struct inode *inode, uint32_t idx){
-	uint32_t block_size, items_per_block, ids_per_level;
+	struct inode_extent extent;
+
+	inode_map_range(d,inode,idx,1,&extent,1);
+	return extent.physical;
+}
+
+/* Map COUNT logical blocks of INODE starting at FIRST to runs of
+ * physically contiguous blocks, stored in EXTENTS. Unallocated blocks
+ * are mapped to physical block 0.
+ * The indirect blocks are walked once, each one is borrowed from the
+ * buffer cache only while the walk is inside it.
+ * Returns the number of extents filled, at most MAX_EXTENTS. If it is
+ * MAX_EXTENTS the range may not be completely mapped, the caller continues
+ * after the last extent.
+*/
+int inode_map_range(struct block *d, struct inode *inode, uint32_t first, uint32_t count, struct inode_extent *extents, int max_extents){
 	struct ext2_meta_data *meta;
+	struct cache_block *level_b[3] = {NULL, NULL, NULL};
+	uint32_t level_id[3] = {0, 0, 0};
+	uint32_t path[3];
+	uint32_t block_size, items_per_block, idx, rel, root, physical, depth, i;
+	int cnt = 0;
 
-	ASSERT(d != NULL && inode != NULL);
+	ASSERT(d != NULL && inode != NULL && extents != NULL);
+	ASSERT(max_extents > 0);
 
 	// get device meta data
 	meta = ext2_get_meta(d);
@@ -297,71 +1236,153 @@ static uint32_t inode_get_data_block (struct block *d, struct inode *inode, uint
 	block_size = ext2_get_block_size(meta->sb);
 	items_per_block = block_size / sizeof(uint32_t);
 
-	// if block is within first 12 blocks
-	ids_per_level = DIRECT_BLOCKS;
-	if(idx < ids_per_level) return inode->i_block[idx];
-	
-	// check idx against block link lists
-	idx -= ids_per_level;
-	ids_per_level = items_per_block; //first level link list
-	if(idx < ids_per_level) return inode_traverse_linklist(d,inode->i_block[12],idx,0);
+	for(idx = first; idx < first + count; idx++){
+		// Locate the tree holding idx and the path through it
+		rel = idx;
+		if(rel < DIRECT_BLOCKS){
+			root = 0;
+			depth = 0;
+			physical = inode->i_block[rel];
+		}
+		else if((rel -= DIRECT_BLOCKS) < items_per_block){
+			root = inode->i_block[DIRECT_BLOCKS];
+			depth = 1;
+			path[0] = rel;
+		}
+		else if((rel -= items_per_block) < items_per_block*items_per_block){
+			root = inode->i_block[DIRECT_BLOCKS+1];
+			depth = 2;
+			path[0] = rel / items_per_block;
+			path[1] = rel % items_per_block;
+		}
+		else{
+			rel -= items_per_block*items_per_block;
+			ASSERT(rel / items_per_block / items_per_block < items_per_block);
+			root = inode->i_block[DIRECT_BLOCKS+2];
+			depth = 3;
+			path[0] = rel / items_per_block / items_per_block;
+			path[1] = (rel / items_per_block) % items_per_block;
+			path[2] = rel % items_per_block;
+		}
 
-	idx -= ids_per_level;
-	ids_per_level *= items_per_block; //second level link list
-	if(idx < ids_per_level) return inode_traverse_linklist(d,inode->i_block[13],idx,1);
+		// Walk indirect levels, reusing blocks borrowed for previous idx
+		physical = depth == 0 ? physical : root;
+		for(i = 0; i < depth && physical != 0; i++){
+			if(level_b[i] == NULL || level_id[i] != physical){
+				if(level_b[i] != NULL) cache_put(level_b[i]);
+				level_b[i] = cache_get(d,physical,true);
+				level_id[i] = physical;
+			}
+			physical = ((uint32_t*)cache_data(level_b[i]))[path[i]];
+		}
+
+		// Extend current extent or start a new one
+		if(cnt > 0){
+			struct inode_extent *e = &extents[cnt-1];
+			if((e->physical == 0 && physical == 0)
+				|| (e->physical != 0 && physical == e->physical + e->length)){
+				e->length++;
+				continue;
+			}
+			if(cnt == max_extents) break;
+		}
+		extents[cnt].logical = idx;
+		extents[cnt].physical = physical;
+		extents[cnt].length = 1;
+		cnt++;
+	}
 
-	idx -= ids_per_level;
-	ids_per_level *= items_per_block; //third level link list
-	if(idx < ids_per_level) return inode_traverse_linklist(d,inode->i_block[14],idx,2);
+	// Return borrowed blocks
+	for(i = 0; i < 3; i++)
+		if(level_b[i] != NULL) cache_put(level_b[i]);
 
-	PANIC("Block ID [%u] Excceded EXT2 Limit.",idx);
+	return cnt;
 }
 
-/* Get IDX th entry from block specified by BLOCK ID recursively until LEVEL == 0*/
-static uint32_t inode_traverse_linklist(struct block *d, uint32_t block_id, uint32_t idx, uint32_t level){
-	int i;
-	uint32_t block_size, items_per_block, ids_per_entry, table_idx;
+/* Count the runs of physically contiguous data blocks of INODE.
+ * A file laid out in one run has 1 extent, holes are not counted.
+*/
+uint32_t inode_extent_count(struct block *d, struct inode *inode){
 	struct ext2_meta_data *meta;
-	uint32_t *array;
+	struct inode_extent extents[INODE_MAP_BATCH];
+	uint32_t block_size, first, blocks, last_end = 0, total = 0;
+	int cnt, i;
 
-	ASSERT(d != NULL);
+	ASSERT(d != NULL && inode != NULL);
 
-	// get device meta data
 	meta = ext2_get_meta(d);
 	ASSERT(meta != NULL && meta->sb != NULL);
 	block_size = ext2_get_block_size(meta->sb);
-	items_per_block = block_size / sizeof(uint32_t);
+	blocks = DIV_ROUND_UP(inode->i_size,block_size);
+
+	for(first = 0; first < blocks; ){
+		cnt = inode_map_range(d,inode,first,blocks - first,extents,INODE_MAP_BATCH);
+		for(i = 0; i < cnt; i++){
+			if(extents[i].physical == 0) continue;
+			// Batches may split a run, join it back
+			if(extents[i].physical != last_end) total++;
+			last_end = extents[i].physical + extents[i].length;
+		}
+		first = extents[cnt-1].logical + extents[cnt-1].length;
+	}
 
-	// calculate number of ids per entry
-	// and local table index
-	ids_per_entry = 1;
-	for(i=0;i<level;i++) ids_per_entry *= items_per_block;
-	table_idx = idx / ids_per_entry;
+	return total;
+}
 
-	// get local table entry
-	array = ext2_read_block(d,block_id,block_size,NULL);
-	block_id = array[table_idx];
-	kfree(array);
+/* Allocate the data blocks of inode INO from OFFSET to OFFSET+LEN,
+ * like posix_fallocate(). Holes in the range are filled, the file is
+ * extended if the range passes its end. New blocks read as zeros.
+ * Returns 0 on success, -1 on failure.
+*/
+int inode_fallocate(struct block *d, uint32_t ino, struct inode *inode, off_t offset, off_t len){
+	struct ext2_meta_data *meta;
+	struct cache_block *b;
+	uint32_t block_size, end, allocated = 0, block_id;
+	int err;
+
+	ASSERT(d != NULL && inode != NULL);
+	if(offset < 0 || len <= 0 || len > INT32_MAX - offset) return -1;
+
+	meta = ext2_get_meta(d);
+	ASSERT(meta != NULL && meta->sb != NULL);
+	block_size = ext2_get_block_size(meta->sb);
+	end = offset + len;
+
+	// Check the block map can hold the range
+	if(DIV_ROUND_UP(end,block_size) > inode_max_blocks(block_size/sizeof(uint32_t))) return -1;
 
-	// if not reach leaf level
-	if(level > 0){
-		idx = idx - table_idx * ids_per_entry;
-		level = level - 1;
-		block_id = inode_traverse_linklist(d,block_id,idx,level);
+	// Bytes past the old end in its last block become part of the file
+	if(end > inode->i_size && inode->i_size % block_size != 0){
+		block_id = inode_get_data_block(d,inode,inode->i_size / block_size);
+		if(block_id != 0){
+			b = cache_get(d,block_id,true);
+			memset((uint8_t*)cache_data(b) + inode->i_size % block_size,0,block_size - inode->i_size % block_size);
+			cache_mark_dirty(b);
+			cache_put(b);
+		}
 	}
 
-	return block_id;
+	err = inode_fill_range(d,ino,inode,offset / block_size,(end - 1) / block_size,true,&allocated);
+
+	// Important: i_blocks are number of 512 byte sectors, not fs blocks !!
+	inode->i_blocks += allocated*(2<<meta->sb->s_log_block_size);
+	if(err == 0 && end > inode->i_size) inode->i_size = end;
+
+	return err;
 }
 
-/* Resize the data block of an inode, to hold at least BYTES bytes*/
-int inode_resize(struct inode *inode, uint32_t bytes){
+/* Resize the data block of inode INO, to hold at least BYTES bytes.
+ * New blocks are placed after the last block of the file,
+ * or in the block group of the inode for an empty file.
+ * i_blocks changes by the blocks allocated or freed, holes left by
+ * inode_fallocate() or sparse files stay out of the count.
+*/
+int inode_resize(uint32_t ino, struct inode *inode, uint32_t bytes){
 	struct block *d;
 	struct ext2_meta_data *meta;
-	uint32_t block_size, items_per_block, fs_blocks, old_fs_blocks,block_id;
-	int indirect_blocks;
-	uint32_t start_idx, end_idx;
-	enum RANGE range_comparison;
-	int i;
+	uint32_t block_size, items_per_block, fs_blocks, old_fs_blocks;
+	uint32_t allocated = 0, released = 0;
+	int err;
 
 	ASSERT(inode != NULL);
 
@@ -377,12 +1398,8 @@ int inode_resize(struct inode *inode, uint32_t bytes){
 	fs_blocks = DIV_ROUND_UP(bytes,block_size);
 	old_fs_blocks = DIV_ROUND_UP(inode->i_size,block_size);
 
-	/* Calculate indirect blocks
-	 * Important: the inode->i_blocks field is the number of DISK SECTORS (512bytes)
-	 * to hold all data of inode, includes direct blocks and INDIRECT BLOCKS!!
-	*/
-	indirect_blocks = inode_get_indirect_blocks(fs_blocks,items_per_block);
-	if(indirect_blocks < 0) return -1;
+	// Check the block map can hold the new size
+	if(fs_blocks > inode_max_blocks(items_per_block)) return -1;
 
 	// If blocks does not expand or shrink
 	if(fs_blocks == old_fs_blocks) goto done;
@@ -394,66 +1411,11 @@ int inode_resize(struct inode *inode, uint32_t bytes){
 	ASSERT(fs_blocks > old_fs_blocks);
 
 	/* Note: Expansion range is from i_blocks to blocks-1 (old_fs_blocks to fs_blocks-1) inclusive */
-
-	// Check direct blocks
-	for (i = old_fs_blocks; i < DIRECT_BLOCKS && i < fs_blocks; i++){
-		block_id = inode->i_block[i];
-		if(block_id == 0){
-			block_id = freemap_get_block(false);
-			if(block_id != FREEMAP_GET_ERROR) inode->i_block[i] = block_id;
-			else {return -1;}
-		}
-	}
-
-	// Check singly indirect blocks
-	start_idx = inode_get_direct_block_idx(items_per_block,DIRECT_BLOCKS,0,0,0);
-	end_idx = inode_get_direct_block_idx(items_per_block,DIRECT_BLOCKS,
-		items_per_block-1,items_per_block-1,items_per_block-1);
-	range_comparison = inode_range_compare(old_fs_blocks,fs_blocks-1,start_idx,end_idx);
-	if((range_comparison & RANGE_OVERLAP) > 0){
-		block_id = inode->i_block[DIRECT_BLOCKS];
-		if(block_id == 0){
-			block_id = freemap_get_block(true);
-			if(block_id != FREEMAP_GET_ERROR) inode->i_block[DIRECT_BLOCKS] = block_id;
-			else {return -1;}
-		}
-		inode_expand_range(block_id,1,old_fs_blocks,fs_blocks-1,items_per_block,DIRECT_BLOCKS,0,0,0);
-	}
-	// Level range passed expansion range
-	else if ((range_comparison & RANGE_AHEAD) > 0)
-		goto done;
-
-	// Check doubly indirect blocks
-	start_idx = inode_get_direct_block_idx(items_per_block,DIRECT_BLOCKS+1,0,0,0);
-	end_idx = inode_get_direct_block_idx(items_per_block,DIRECT_BLOCKS+1,
-		items_per_block-1,items_per_block-1,items_per_block-1);
-	range_comparison = inode_range_compare(old_fs_blocks,fs_blocks-1,start_idx,end_idx);
-	if((range_comparison & RANGE_OVERLAP) > 0){
-		block_id = inode->i_block[DIRECT_BLOCKS+1];
-		if(block_id == 0){
-			block_id = freemap_get_block(true);
-			if(block_id != FREEMAP_GET_ERROR) inode->i_block[DIRECT_BLOCKS+1] = block_id;
-			else {return -1;}
-		}
-		inode_expand_range(block_id,1,old_fs_blocks,fs_blocks-1,items_per_block,DIRECT_BLOCKS+1,0,0,0);
-	}
-	// Level range passed expansion range
-	else if ((range_comparison & RANGE_AHEAD) > 0)
-		goto done;
-
-	// Check triply indirect blocks
-	start_idx = inode_get_direct_block_idx(items_per_block,DIRECT_BLOCKS+2,0,0,0);
-	end_idx = inode_get_direct_block_idx(items_per_block,DIRECT_BLOCKS+2,
-		items_per_block-1,items_per_block-1,items_per_block-1);
-	range_comparison = inode_range_compare(old_fs_blocks,fs_blocks-1,start_idx,end_idx);
-	if((range_comparison & RANGE_OVERLAP) > 0){
-		block_id = inode->i_block[DIRECT_BLOCKS+2];
-		if(block_id == 0){
-			block_id = freemap_get_block(true);
-			if(block_id != FREEMAP_GET_ERROR) inode->i_block[DIRECT_BLOCKS+2] = block_id;
-			else {return -1;}
-		}
-		inode_expand_range(block_id,1,old_fs_blocks,fs_blocks-1,items_per_block,DIRECT_BLOCKS+2,0,0,0);
+	err = inode_fill_range(d,ino,inode,old_fs_blocks,fs_blocks-1,false,&allocated);
+	if(err < 0){
+		// Blocks allocated before the failure stay in the block map
+		inode->i_blocks += allocated*(2<<meta->sb->s_log_block_size);
+		return -1;
 	}
 
 	// Finished. Go to done
@@ -464,94 +1426,165 @@ shrink:
 	ASSERT(fs_blocks < old_fs_blocks);
  
 	/* Note: Shrink range is from blocks to i_blocks-1 (fs_blocks to old_fs_blocks-1) inclusive */
+	released = inode_release_range(d,inode,fs_blocks,old_fs_blocks-1);
+
+done:
+	// Set new size
+	inode->i_size = bytes;
+	/* Important: the inode->i_blocks field is the number of DISK SECTORS (512bytes)
+	 * to hold all data of inode, includes direct blocks and INDIRECT BLOCKS!!
+	*/
+	inode->i_blocks += allocated*(2<<meta->sb->s_log_block_size);
+	inode->i_blocks -= released*(2<<meta->sb->s_log_block_size);
+
+	return 0;
+}
+/* Allocate the missing data blocks FIRST to LAST (inclusive) of inode INO,
+ * and the indirect blocks leading to them. Blocks are taken from the free
+ * map in contiguous runs placed after the block before FIRST, and every
+ * indirect block is visited once. With ZERO new data blocks are zeroed.
+ * The number of blocks allocated, indirect ones included, is stored in
+ * *ALLOCATED if it is not NULL. Returns 0 on success, -1 if out of space.
+*/
+static int inode_fill_range(struct block *d, uint32_t ino, struct inode *inode, uint32_t first, uint32_t last, bool zero, uint32_t *allocated){
+	struct ext2_meta_data *meta;
+	struct inode_alloc ctx;
+	uint32_t block_size, items_per_block, block_id;
+	uint32_t start_idx, end_idx;
+	enum RANGE range_comparison;
+	int i, ret = 0;
+
+	meta = ext2_get_meta(d);
+	ASSERT(meta != NULL && meta->sb != NULL);
+	block_size = ext2_get_block_size(meta->sb);
+	items_per_block = block_size/sizeof(uint32_t);
+	ASSERT(first <= last);
+
+	// Allocate after the block before the range, else close to the inode
+	memset(&ctx,0,sizeof(ctx));
+	ctx.zero = zero;
+	ctx.goal = first > 0 ? inode_get_data_block(d,inode,first-1) : 0;
+	if(ctx.goal != 0) ctx.goal++;
+	else ctx.goal = freemap_inode_goal(ino);
+	// Upper bound of the blocks needed, sizes the runs requested
+	ctx.want = last - first + 1 + inode_get_indirect_blocks(last + 1,items_per_block);
 
 	// Check direct blocks
-	for (i = fs_blocks; i < DIRECT_BLOCKS && i < old_fs_blocks; i++){
+	for (i = first; i < DIRECT_BLOCKS && i <= last; i++){
 		block_id = inode->i_block[i];
-		if(block_id != 0){
-			// free block
-			freemap_free_block(block_id);
-			// set entry to zero
-			inode->i_block[i] = 0;
+		if(block_id == 0){
+			block_id = inode_alloc_block(&ctx,false);
+			if(block_id != FREEMAP_GET_ERROR) inode->i_block[i] = block_id;
+			else {ret = -1; goto done;}
 		}
 	}
 
-	// Check singly indirect blocks
-	start_idx = inode_get_direct_block_idx(items_per_block,DIRECT_BLOCKS,0,0,0);
-	end_idx = inode_get_direct_block_idx(items_per_block,DIRECT_BLOCKS,
-		items_per_block-1,items_per_block-1,items_per_block-1);
-	range_comparison = inode_range_compare(fs_blocks,old_fs_blocks-1,start_idx,end_idx);
-	if((range_comparison & RANGE_OVERLAP) > 0){
-		block_id = inode->i_block[DIRECT_BLOCKS];
-		if(block_id != 0){
-			// Shrink sub range first
-			inode_shrink_range(block_id,1,fs_blocks,old_fs_blocks-1,
-				items_per_block,DIRECT_BLOCKS,0,0,0);
-			// If shrink range contains all singly indirect blocks
-			if(fs_blocks <= start_idx){
-				// free block and delete entry
-				freemap_free_block(block_id);
-				inode->i_block[DIRECT_BLOCKS] = 0;
+	// Check indirect trees
+	for (i = DIRECT_BLOCKS; i < DIRECT_BLOCKS + 3; i++){
+		start_idx = inode_get_direct_block_idx(items_per_block,i,0,0,0);
+		end_idx = inode_get_direct_block_idx(items_per_block,i,
+			items_per_block-1,items_per_block-1,items_per_block-1);
+		range_comparison = inode_range_compare(first,last,start_idx,end_idx);
+		if((range_comparison & RANGE_OVERLAP) > 0){
+			block_id = inode->i_block[i];
+			if(block_id == 0){
+				block_id = inode_alloc_block(&ctx,true);
+				if(block_id != FREEMAP_GET_ERROR) inode->i_block[i] = block_id;
+				else {ret = -1; goto done;}
 			}
+			ret = inode_expand_range(block_id,1,first,last,items_per_block,i,0,0,0,&ctx);
+			if(ret < 0) goto done;
 		}
+		// Level range passed expansion range
+		else if ((range_comparison & RANGE_AHEAD) > 0)
+			break;
 	}
-	// if level range passed shrink range
-	else if ((range_comparison & RANGE_AHEAD) > 0)
-		goto done;
 
-	// Check doubly indirect blocks
-	start_idx = inode_get_direct_block_idx(items_per_block,DIRECT_BLOCKS+1,0,0,0);
-	end_idx = inode_get_direct_block_idx(items_per_block,DIRECT_BLOCKS+1,
-		items_per_block-1,items_per_block-1,items_per_block-1);
-	range_comparison = inode_range_compare(fs_blocks,old_fs_blocks-1,start_idx,end_idx);
-	if((range_comparison & RANGE_OVERLAP) > 0){
-		block_id = inode->i_block[DIRECT_BLOCKS+1];
-		if(block_id != 0){
-			inode_shrink_range(block_id,1,fs_blocks,old_fs_blocks-1,
-				items_per_block,DIRECT_BLOCKS+1,0,0,0);
-			// If shrink range contains all doubly indirect blocks
-			if(fs_blocks <= start_idx){
-				// free block and delete entry
-				freemap_free_block(block_id);
-				inode->i_block[DIRECT_BLOCKS+1] = 0;
-			}
+done:
+	// Zero pending data blocks, return the unused part of the last run
+	inode_alloc_finish(&ctx);
+	if(allocated != NULL) *allocated = ctx.allocated;
+
+	return ret;
+}
+/* Take the next block of the current run of CTX, a new run is
+ * allocated when it is used up. INDIRECT blocks are always zeroed,
+ * data blocks if CTX asks for it.
+*/
+static uint32_t inode_alloc_block(struct inode_alloc *ctx, bool indirect){
+	struct block *d = block_get_role(BLOCK_FILESYS);
+	struct ext2_meta_data *meta = ext2_get_meta(d);
+	uint32_t block_size = ext2_get_block_size(meta->sb);
+	struct cache_block *b;
+	uint32_t block_id;
+
+	// Allocate next run
+	if(ctx->left == 0){
+		ctx->left = ctx->want > 0 ? ctx->want : 1;
+		ctx->next = freemap_get_run(ctx->goal,&ctx->left,false);
+		if(ctx->next == FREEMAP_GET_ERROR){
+			ctx->left = 0;
+			return FREEMAP_GET_ERROR;
 		}
 	}
-	// if level range passed shrink range
-	else if ((range_comparison & RANGE_AHEAD) > 0)
-		goto done;
-
-	// Check triply indirect blocks
-	start_idx = inode_get_direct_block_idx(items_per_block,DIRECT_BLOCKS+2,0,0,0);
-	end_idx = inode_get_direct_block_idx(items_per_block,DIRECT_BLOCKS+2,
-		items_per_block-1,items_per_block-1,items_per_block-1);
-	range_comparison = inode_range_compare(fs_blocks,old_fs_blocks-1,start_idx,end_idx);
-	if((range_comparison & RANGE_OVERLAP) > 0){
-		block_id = inode->i_block[DIRECT_BLOCKS+2];
-		if(block_id != 0){
-			inode_shrink_range(block_id,1,fs_blocks,old_fs_blocks-1,
-				items_per_block,DIRECT_BLOCKS+2,0,0,0);
-			// If shrink range contains all triply indirect blocks
-			if(fs_blocks <= start_idx){
-				// free block and delete entry
-				freemap_free_block(block_id);
-				inode->i_block[DIRECT_BLOCKS+2] = 0;
-			}
+	block_id = ctx->next++;
+	ctx->left--;
+	if(ctx->want > 0) ctx->want--;
+	ctx->goal = ctx->next;
+	ctx->allocated++;
+
+	if(indirect){
+		// Indirect blocks are filled in through the cache
+		b = cache_get(d,block_id,false);
+		memset(cache_data(b),0,block_size);
+		cache_mark_dirty(b);
+		cache_put(b);
+	}
+	else if(ctx->zero){
+		// Gather consecutive data blocks, zeroed in one request
+		if(ctx->zero_cnt > 0 && ctx->zero_start + ctx->zero_cnt != block_id)
+			inode_zero_blocks(d,ctx->zero_start,ctx->zero_cnt,block_size);
+		if(ctx->zero_cnt == 0 || ctx->zero_start + ctx->zero_cnt != block_id){
+			ctx->zero_start = block_id;
+			ctx->zero_cnt = 0;
 		}
+		ctx->zero_cnt++;
 	}
 
-done:
-	// Set new size
-	inode->i_size = bytes;
-	// Important: i_blocks are number of 512 byte sectors, not fs blocks !!
-	// Note: do this after the expansion or truncation.
-	inode->i_blocks = (fs_blocks+indirect_blocks)*(2<<meta->sb->s_log_block_size);
-
-	return 0;
+	return block_id;
 }
-static int inode_expand_range(uint32_t block_id, uint32_t level, uint32_t start, uint32_t end, uint32_t items_per_block,uint32_t l0, uint32_t l1, uint32_t l2, uint32_t l3){
+/* Zero pending data blocks and free the unused part of the last run */
+static void inode_alloc_finish(struct inode_alloc *ctx){
+	struct block *d = block_get_role(BLOCK_FILESYS);
+	struct ext2_meta_data *meta = ext2_get_meta(d);
+
+	if(ctx->zero_cnt > 0)
+		inode_zero_blocks(d,ctx->zero_start,ctx->zero_cnt,ext2_get_block_size(meta->sb));
+	ctx->zero_cnt = 0;
+	if(ctx->left > 0)
+		freemap_free_blocks(ctx->next,ctx->left);
+	ctx->left = 0;
+}
+/* Write zeros to COUNT blocks starting at BLOCK_IDX, in large requests */
+static void inode_zero_blocks(struct block *d, uint32_t block_idx, uint32_t count, uint32_t block_size){
+	uint32_t chunk = INODE_ZERO_CHUNK < count ? INODE_ZERO_CHUNK : count;
+	uint8_t *zeros = kmalloc(chunk * block_size);
+	uint32_t n;
+
+	ASSERT(zeros != NULL);
+	memset(zeros,0,chunk * block_size);
+	while(count > 0){
+		n = chunk < count ? chunk : count;
+		ext2_write_blocks(d,block_idx,n,block_size,zeros);
+		block_idx += n;
+		count -= n;
+	}
+	kfree(zeros);
+}
+static int inode_expand_range(uint32_t block_id, uint32_t level, uint32_t start, uint32_t end, uint32_t items_per_block,uint32_t l0, uint32_t l1, uint32_t l2, uint32_t l3, struct inode_alloc *ctx){
 	struct block *d = block_get_role(BLOCK_FILESYS);
 	uint32_t item_start, item_end;
+	struct cache_block *b;
 	uint32_t *level_data;
 	uint32_t block_id2;
 	int i, ret = 0;
@@ -560,7 +1593,8 @@ static int inode_expand_range(uint32_t block_id, uint32_t level, uint32_t start,
 	ASSERT(d != NULL);
 	ASSERT(level > 0);
 
-	level_data = ext2_read_block(d,block_id,items_per_block*sizeof(uint32_t),NULL);
+	b = cache_get(d,block_id,true);
+	level_data = cache_data(b);
 	for(i = 0; i < items_per_block; i++){
 		// Get Block range the item represents
 		if(level == 1){
@@ -581,8 +1615,7 @@ static int inode_expand_range(uint32_t block_id, uint32_t level, uint32_t start,
 			block_id2 = level_data[i];
 			// Allocate block in disk if not exist.
 			if(block_id2 == 0){
-				if(item_start == item_end) block_id2 = freemap_get_block(false);
-				else block_id2 = freemap_get_block(true);	
+				block_id2 = inode_alloc_block(ctx,item_start != item_end);
 #ifdef FILESYS_EXT2_DEBUG
 				printf(" New block id: 0x%x for %d/%d/%d/%d:%d\n",
 					block_id2,l0,l1,l2,l3,i);
@@ -596,11 +1629,12 @@ static int inode_expand_range(uint32_t block_id, uint32_t level, uint32_t start,
 			if(item_start == item_end) continue;
 			/* If not leaf node*/
 			if(level == 1)
-				inode_expand_range(block_id2,level+1,start,end,items_per_block,l0,i,0,0);
+				ret = inode_expand_range(block_id2,level+1,start,end,items_per_block,l0,i,0,0,ctx);
 			else if(level == 2)
-				inode_expand_range(block_id2,level+1,start,end,items_per_block,l0,l1,i,0);
+				ret = inode_expand_range(block_id2,level+1,start,end,items_per_block,l0,l1,i,0,ctx);
 			else
 				PANIC("Inode Fill Range Reach Unexpected Level.\n");
+			if(ret < 0) break;
 		}
 		else if((range_comparison & RANGE_AHEAD) > 0){ //Ahead of start
 			continue;
@@ -609,14 +1643,95 @@ static int inode_expand_range(uint32_t block_id, uint32_t level, uint32_t start,
 			break;
 		}
 	}
-	ext2_write_block(d,block_id,items_per_block*sizeof(uint32_t),level_data);
-	kfree(level_data);
+	cache_mark_dirty(b);
+	cache_put(b);
 
 	return ret;
 }
-static int inode_shrink_range(uint32_t block_id, uint32_t level, uint32_t start, uint32_t end, uint32_t items_per_block,uint32_t l0, uint32_t l1, uint32_t l2, uint32_t l3){
+/* Free the data blocks FIRST to LAST (inclusive) of INODE, and the
+ * indirect blocks left without entries. Freed blocks are collected in
+ * runs and returned to the free map in batches. Returns the number of
+ * blocks freed, indirect ones included.
+*/
+static uint32_t inode_release_range(struct block *d, struct inode *inode, uint32_t first, uint32_t last){
+	struct ext2_meta_data *meta;
+	struct inode_release ctx;
+	uint32_t block_size, items_per_block, block_id;
+	uint32_t start_idx, end_idx;
+	enum RANGE range_comparison;
+	int i;
+
+	meta = ext2_get_meta(d);
+	ASSERT(meta != NULL && meta->sb != NULL);
+	block_size = ext2_get_block_size(meta->sb);
+	items_per_block = block_size/sizeof(uint32_t);
+	ASSERT(first <= last);
+
+	ctx.cnt = 0;
+	ctx.released = 0;
+
+	// Check direct blocks
+	for (i = first; i < DIRECT_BLOCKS && i <= last; i++){
+		block_id = inode->i_block[i];
+		if(block_id != 0){
+			// free block
+			inode_release_block(&ctx,block_id);
+			// set entry to zero
+			inode->i_block[i] = 0;
+		}
+	}
+
+	// Check indirect trees
+	for (i = DIRECT_BLOCKS; i < DIRECT_BLOCKS + 3; i++){
+		start_idx = inode_get_direct_block_idx(items_per_block,i,0,0,0);
+		end_idx = inode_get_direct_block_idx(items_per_block,i,
+			items_per_block-1,items_per_block-1,items_per_block-1);
+		range_comparison = inode_range_compare(first,last,start_idx,end_idx);
+		if((range_comparison & RANGE_OVERLAP) > 0){
+			block_id = inode->i_block[i];
+			if(block_id != 0){
+				// Shrink sub range first
+				inode_shrink_range(block_id,1,first,last,items_per_block,i,0,0,0,&ctx);
+				// If shrink range contains the whole tree
+				if(first <= start_idx){
+					// free block and delete entry
+					inode_release_block(&ctx,block_id);
+					inode->i_block[i] = 0;
+				}
+			}
+		}
+		// if level range passed shrink range
+		else if ((range_comparison & RANGE_AHEAD) > 0)
+			break;
+	}
+
+	// Return the last batch
+	freemap_free_extents(ctx.extents,ctx.cnt);
+	return ctx.released;
+}
+/* Add BLOCK_ID to the blocks freed by CTX */
+static void inode_release_block(struct inode_release *ctx, uint32_t block_id){
+	struct freemap_extent *last = ctx->cnt > 0 ? &ctx->extents[ctx->cnt-1] : NULL;
+
+	ctx->released++;
+	// Extend the current run
+	if(last != NULL && last->start + last->count == block_id){
+		last->count++;
+		return;
+	}
+	// Batch is full, return it
+	if(ctx->cnt == INODE_RELEASE_BATCH){
+		freemap_free_extents(ctx->extents,ctx->cnt);
+		ctx->cnt = 0;
+	}
+	ctx->extents[ctx->cnt].start = block_id;
+	ctx->extents[ctx->cnt].count = 1;
+	ctx->cnt++;
+}
+static int inode_shrink_range(uint32_t block_id, uint32_t level, uint32_t start, uint32_t end, uint32_t items_per_block,uint32_t l0, uint32_t l1, uint32_t l2, uint32_t l3, struct inode_release *ctx){
 	struct block *d = block_get_role(BLOCK_FILESYS);
 	uint32_t item_start, item_end;
+	struct cache_block *b;
 	uint32_t *level_data;
 	uint32_t block_id2;
 	int i, ret = 0;
@@ -625,7 +1740,8 @@ static int inode_shrink_range(uint32_t block_id, uint32_t level, uint32_t start,
 	ASSERT(d != NULL);
 	ASSERT(level > 0);
 
-	level_data = ext2_read_block(d,block_id,items_per_block*sizeof(uint32_t),NULL);
+	b = cache_get(d,block_id,true);
+	level_data = cache_data(b);
 	for(i = 0; i < items_per_block; i++){
 		// Get Block range the item represents
 		if(level == 1){
@@ -651,7 +1767,7 @@ static int inode_shrink_range(uint32_t block_id, uint32_t level, uint32_t start,
 			/* If it is a leaf node */
 			if(item_start == item_end) {
 				// free block and set entry to zero
-				freemap_free_block(block_id2);
+				inode_release_block(ctx,block_id2);
 				level_data[i] = 0;
 				continue;
 			}
@@ -660,16 +1776,16 @@ static int inode_shrink_range(uint32_t block_id, uint32_t level, uint32_t start,
 
 			// free sub level
 			if(level == 1)
-				inode_shrink_range(block_id2,level+1,start,end,items_per_block,l0,i,0,0);
+				inode_shrink_range(block_id2,level+1,start,end,items_per_block,l0,i,0,0,ctx);
 			else if(level == 2)
-				inode_shrink_range(block_id2,level+1,start,end,items_per_block,l0,l1,i,0);
+				inode_shrink_range(block_id2,level+1,start,end,items_per_block,l0,l1,i,0,ctx);
 			else
 				PANIC("Inode Shrink Range Reach Unexpected Level.\n");
 
 			// if shrink range contains entire level
 			if(start <= item_start){
 				// free block and set entry to zero
-				freemap_free_block(block_id2);
+				inode_release_block(ctx,block_id2);
 				level_data[i] = 0;
 			}
 		}
@@ -680,8 +1796,8 @@ static int inode_shrink_range(uint32_t block_id, uint32_t level, uint32_t start,
 			break;
 		}
 	}
-	ext2_write_block(d,block_id,items_per_block*sizeof(uint32_t),level_data);
-	kfree(level_data);
+	cache_mark_dirty(b);
+	cache_put(b);
 
 	return ret;
 }
@@ -717,6 +1833,12 @@ static uint32_t inode_get_direct_block_idx(uint32_t items_per_block, uint32_t l0
 	// Error
 	return UINT32_MAX;
 }
+/* Most data blocks the block map of an inode can address */
+static uint64_t inode_max_blocks(uint32_t items_per_block){
+	uint64_t n = items_per_block;
+
+	return DIRECT_BLOCKS + n + n*n + n*n*n;
+}
 /* Returns the number of indirect blocks required for DIRECT_BLOCKS */
 static int inode_get_indirect_blocks(uint32_t direct_blocks, uint32_t items_per_block){
 	int blocks = direct_blocks;
@@ -2,8 +2,10 @@
 #define EXT2_INODE_H
 
 #include <stdint.h>
+#include <stdbool.h>
 #include "devices/block.h"
 #include "filesys/off_t.h"
+#include "kernel/synch.h"
 
 // inode table structure
 struct inode {
@@ -27,6 +29,9 @@ struct inode {
 	uint8_t i_osd2[12];
 } __attribute__((packed));
 
+// definitions for i_flags
+#define EXT2_INDEX_FL	0x00001000	//hash indexed directory
+
 // Reserved Inodes in Inode Table
 #define EXT2_BAD_INO			1
 #define EXT2_ROOT_INO			2
@@ -58,13 +63,70 @@ struct inode {
 #define EXT2_S_IWOTH	0x0002		//others write
 #define EXT2_S_IXOTH	0x0001		//others execute
 
+// run of contiguous data blocks, physical is 0 if not allocated
+struct inode_extent {
+	uint32_t logical;
+	uint32_t physical;
+	uint32_t length;
+};
+
+// readahead window limits in bytes
+#define INODE_RA_MIN_WINDOW (16*1024)
+#define INODE_RA_MAX_WINDOW (1024*1024)
+
+// readahead policy of an open file, see file_advise()
+enum INODE_RA_MODE{
+	INODE_RA_NORMAL,
+	INODE_RA_SEQUENTIAL,	// windows start at the largest size
+	INODE_RA_RANDOM,		// no readahead
+};
+
+// what inode_cache_range() does with the cached data blocks of a range
+enum INODE_CACHE_OP{
+	INODE_CACHE_PREFETCH,	// read them ahead of use
+	INODE_CACHE_DEMOTE,		// have them replaced first
+	INODE_CACHE_DROP,		// write them back and drop them
+};
+
+// sequential readahead state of an open file
+struct inode_readahead {
+	struct lock lock;	// positional reads update it in parallel
+	enum INODE_RA_MODE mode;
+	off_t next;		// offset a sequential read starts at
+	off_t start;	// start of current window
+	off_t size;		// size of current window, 0 if access is not sequential
+};
+
 // define default file permission
 #define EXT2_DEFAULT_PERMISSION (EXT2_S_IRUSR|EXT2_S_IWUSR|EXT2_S_IRGRP|EXT2_S_IWGRP|EXT2_S_IROTH)
+void inode_cache_init(void);
+void inode_cache_free(void);
 struct inode *ext2_get_inode(struct block *b, uint32_t ino_idx);
+struct inode *inode_reopen(struct inode *inode);
+void ext2_put_inode(struct block *b, struct inode *inode);
 void ext2_write_inode(struct block *b, uint32_t ino_idx, struct inode *inode);
+void inode_unlink(struct inode *inode);
+uint32_t inode_get_inumber(struct inode *inode);
+void inode_lock(struct inode *inode);
+void inode_unlock(struct inode *inode);
+void inode_lock_shared(struct inode *inode);
+void inode_unlock_shared(struct inode *inode);
+void inode_mark_dirty(struct inode *inode);
+void inode_flush(struct block *b, struct inode *inode);
+void inode_flush_all(void);
+void inode_sync(struct block *d, struct inode *inode, bool datasync);
 void *inode_get_block_data(struct block *d, struct inode *inode, uint32_t idx);
+int inode_map_range(struct block *d, struct inode *inode, uint32_t first, uint32_t count, struct inode_extent *extents, int max_extents);
 off_t inode_read_at(struct block *d, struct inode *inode, void *buffer_, off_t size, off_t offset);
-off_t inode_write_at(struct block *d, struct inode *inode, const void *buffer_, off_t size, off_t offset);
-int inode_resize(struct inode *inode, uint32_t bytes);
+off_t inode_readv_at(struct block *d, struct inode *inode, const struct block_iovec *iov, size_t iov_cnt, off_t offset, bool direct);
+void inode_readahead_init(struct inode_readahead *ra);
+void inode_readahead(struct block *d, struct inode *inode, struct inode_readahead *ra, off_t offset, off_t size);
+void inode_cache_range(struct block *d, struct inode *inode, off_t offset, off_t len, enum INODE_CACHE_OP op);
+void inode_prefetch(struct block *d, struct inode *inode, off_t offset, off_t len);
+off_t inode_write_at(struct block *d, uint32_t ino, struct inode *inode, const void *buffer_, off_t size, off_t offset);
+off_t inode_writev_at(struct block *d, uint32_t ino, struct inode *inode, const struct block_iovec *iov, size_t iov_cnt, off_t offset, bool direct);
+int inode_resize(uint32_t ino, struct inode *inode, uint32_t bytes);
+int inode_fallocate(struct block *d, uint32_t ino, struct inode *inode, off_t offset, off_t len);
+uint32_t inode_extent_count(struct block *d, struct inode *inode);
 void print_inode(struct inode *ino);
 #endif
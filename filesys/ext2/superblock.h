@@ -58,8 +58,28 @@ struct superblock {
 	uint8_t padding[3]; //reserved for future expansion
 	uint32_t s_default_mount_options;
 	uint32_t s_first_meta_bg;
-	uint8_t unused[760]; //reserved for future revisions
+	uint32_t s_mkfs_time;
+	uint32_t s_jnl_blocks[17];
+	uint32_t s_blocks_count_hi;
+	uint32_t s_r_blocks_count_hi;
+	uint32_t s_free_blocks_hi;
+	uint16_t s_min_extra_isize;
+	uint16_t s_want_extra_isize;
+	uint32_t s_flags;
+	uint8_t unused[668]; //reserved for future revisions
 } __attribute__((packed));
 
+// definitions for s_feature_compat
+#define EXT2_FEATURE_COMPAT_DIR_INDEX	0x0020	//hash indexed directories
+
+// definitions for s_def_hash_version
+#define EXT2_HASH_LEGACY	0
+#define EXT2_HASH_HALF_MD4	1
+#define EXT2_HASH_TEA		2
+
+// definitions for s_flags
+#define EXT2_FLAGS_SIGNED_HASH		0x0001	//directory hash uses signed char
+#define EXT2_FLAGS_UNSIGNED_HASH	0x0002	//directory hash uses unsigned char
+
 void ext2_print_superblock(struct superblock *sb);
 #endif
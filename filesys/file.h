@@ -9,12 +9,25 @@
 
 struct inode;
 
+/* Access pattern hints, see file_advise(). */
+enum FILE_ADVICE{
+	FILE_ADVICE_NORMAL,
+	FILE_ADVICE_SEQUENTIAL,
+	FILE_ADVICE_RANDOM,
+	FILE_ADVICE_WILLNEED,
+	FILE_ADVICE_DONTNEED,
+	FILE_ADVICE_NOREUSE,
+};
+
 struct file {
 	struct block *device;
 	struct directory *dir;
 	struct inode *inode;
 	off_t pos;
 	bool deny_write;
+	bool direct;	// data bypasses the buffer cache, see FILESYS_O_DIRECT
+	bool noreuse;	// data is accessed once, see file_advise()
+	struct inode_readahead ra;
 	struct lock lock;
 };
 
@@ -29,7 +42,19 @@ off_t file_read (struct file *, void *, off_t);
 off_t file_read_at (struct file *, void *, off_t size, off_t start);
 off_t file_write (struct file *, const void *, off_t);
 off_t file_write_at (struct file *, const void *, off_t size, off_t start);
+off_t file_readv (struct file *, const struct block_iovec *, size_t iov_cnt);
+off_t file_readv_at (struct file *, const struct block_iovec *, size_t iov_cnt, off_t start);
+off_t file_writev (struct file *, const struct block_iovec *, size_t iov_cnt);
+off_t file_writev_at (struct file *, const struct block_iovec *, size_t iov_cnt, off_t start);
 int file_truncate(struct file *, off_t size);
+int file_allocate(struct file *, off_t offset, off_t len);
+
+/* Access pattern hints. */
+int file_advise (struct file *, off_t offset, off_t len, enum FILE_ADVICE advice);
+
+/* Durability. */
+void file_fsync (struct file *);
+void file_datasync (struct file *);
 
 /* Preventing writes. */
 void file_deny_write (struct file *);
@@ -17,10 +17,17 @@ enum FILE_TYPE{
 	FILESYS_DIRECTORY,
 };
 
+// OPEN FLAGS
+enum FILE_OPEN_FLAGS{
+	FILESYS_O_DIRECT = 1 << 0,	// file data is not cached, no readahead
+};
+
 void filesys_init (bool format);
 void filesys_done (void);
+void filesys_sync (void);
 bool filesys_create (const char *path, off_t initial_size, enum FILE_TYPE type, uint32_t permission);
 struct file *filesys_open (const char *name);
+struct file *filesys_open_flags (const char *name, int flags);
 bool filesys_remove (const char *name);
 
 #endif /* filesys/filesys.h */
@@ -4,6 +4,17 @@
 #include <list.h>
 #include <stdbool.h>
 
+/* A counting semaphore. */
+struct semaphore 
+  {
+	// Your implementation of semaphore structure.
+  };
+
+void sema_init (struct semaphore *, unsigned value);
+void sema_down (struct semaphore *);
+bool sema_try_down (struct semaphore *);
+void sema_up (struct semaphore *);
+
 /* Lock. */
 struct lock 
   {
@@ -16,4 +27,15 @@ bool lock_try_acquire (struct lock *);
 void lock_release (struct lock *);
 bool lock_held_by_current_thread (const struct lock *);
 
+/* Condition variable. */
+struct condition 
+  {
+	// Your implementation of condition variable structure.
+  };
+
+void cond_init (struct condition *);
+void cond_wait (struct condition *, struct lock *);
+void cond_signal (struct condition *, struct lock *);
+void cond_broadcast (struct condition *, struct lock *);
+
 #endif